@@ -17,6 +17,7 @@
 #include "X86InstrBuilder.h"
 #include "X86TargetMachine.h"
 
+#include "llvm/ADT/SmallPtrSet.h"
 #include "llvm/ADT/Statistic.h"
 #include "llvm/CodeGen/MachineFunctionPass.h"
 #include "llvm/CodeGen/MachineFunction.h"
@@ -24,6 +25,8 @@
 #include "llvm/CodeGen/Passes.h"
 #include "llvm/Support/raw_ostream.h"
 #include "X86GFreeUtils.h"
+#include "X86GFreeAssembler.h"
+#include "X86GFreeSyncAnalysis.h"
 
 using namespace llvm;
 
@@ -31,14 +34,27 @@ using namespace llvm;
 #define DEBUG_TYPE "gfree"
 
 STATISTIC(Rap , "Number of return address protection inserted");
+STATISTIC(X87Rotated , "Number of evil x87 instructions fixed by rotating the stack");
+STATISTIC(TrapBlocks , "Number of shared JCP trap blocks");
+STATISTIC(LocalTraps , "Number of JCP checks too far from a shared trap block");
 namespace {
 
   class GFreeMachinePass : public MachineFunctionPass {
   public:
     GFreeMachinePass() : MachineFunctionPass(ID) {}
     bool runOnMachineFunction(MachineFunction &MF) override;
+    bool doFinalization(Module &M) override {
+      AssemblerContext.reset();
+      Disasm.reset();
+      return false;
+    }
     const char *getPassName() const override { return "GFree Main Module"; }
     static char ID;
+  private:
+    // Created on the first function and shared by all the sync analyses.
+    std::unique_ptr<MCDisassembler> Disasm;
+    // The encoding context, created on first use.
+    std::unique_ptr<GFreeAssembler> AssemblerContext;
   };
 
   char GFreeMachinePass::ID = 0;
@@ -112,6 +128,83 @@ bool handleMOVNTI(MachineInstr *MI){
   return true; 
 }
 
+// The register forms of x87 encode st(i) in the r/m field of the ModRM (11
+// ooo iii): with st(2) and st(3), fadd/fmul/fxch/fcmov* have ModRM c2, c3,
+// ca or cb. The stack slots are known only after the FP stackifier, so we
+// fix them here: rotate the stack (fincstp) until st(i) is st(1), bring the
+// old st(0) back on top with a safe fxch, and undo it after. For st(2):
+// fincstp; fxch st(7); fadd st(0),st(1); fxch st(7); fdecstp
+// Only the live slots st(0)..st(i) are moved around. faddp/fmulp become the
+// non popping form followed by fstp st(0).
+// fld st(2)/st(3) is handled by handleX87Load.
+bool handleX87(MachineInstr *MI){
+  unsigned int StReg = MI->getOperand(0).getReg();
+  if(StReg != X86::ST2 && StReg != X86::ST3)
+    return false;
+
+  MachineBasicBlock *MBB =  MI->getParent();
+  MachineFunction *MF = MBB->getParent();
+  const X86Subtarget &STI = MF->getSubtarget<X86Subtarget>();
+  const X86InstrInfo &TII = *STI.getInstrInfo();
+  DebugLoc DL = MI->getDebugLoc();
+  MachineInstrBuilder MIB;
+  unsigned int Opc = MI->getOpcode();
+  bool Pops = (Opc == X86::ADD_FPrST0) || (Opc == X86::MUL_FPrST0);
+  if(Opc == X86::ADD_FPrST0) Opc = X86::ADD_FrST0;
+  if(Opc == X86::MUL_FPrST0) Opc = X86::MUL_FrST0;
+  // After Rotate fincstp the old st(0) is st(8 - Rotate).
+  unsigned int Rotate = (StReg == X86::ST2) ? 1 : 2;
+  unsigned int OldTop = (StReg == X86::ST2) ? X86::ST7 : X86::ST6;
+
+  GFreeDEBUG(1,"[!] Found evil:" << *MI);
+  for(unsigned int i = 0; i < Rotate; i++)
+    BuildMI(*MBB, MI, DL, TII.get(X86::FINCSTP));
+  BuildMI(*MBB, MI, DL, TII.get(X86::XCH_F)).addReg(OldTop);
+  MIB = BuildMI(*MBB, MI, DL, TII.get(Opc)).addReg(X86::ST1);
+  GFreeDEBUG(2,"> " << *MIB);
+  BuildMI(*MBB, MI, DL, TII.get(X86::XCH_F)).addReg(OldTop);
+  for(unsigned int i = 0; i < Rotate; i++)
+    BuildMI(*MBB, MI, DL, TII.get(X86::FDECSTP));
+  if(Pops)
+    BuildMI(*MBB, MI, DL, TII.get(X86::ST_FPrr)).addReg(X86::ST0);
+  ++X87Rotated;
+  return true;
+}
+
+// fld st(2)/st(3) (d9 c2/c3) can't be rotated like the others: after a
+// fincstp the push would land on the old st(0), which is live. Push a copy
+// of st(0) first, in the slot the fld would take anyway, then rotate until
+// the source is on top and store it over the copy. For st(2):
+// fld st(0); fincstp x3; fst st(5); fdecstp x3
+// (d9 c0, d9 f7, dd d5, d9 f6).
+bool handleX87Load(MachineInstr *MI){
+  unsigned int StReg = MI->getOperand(0).getReg();
+  if(StReg != X86::ST2 && StReg != X86::ST3)
+    return false;
+
+  MachineBasicBlock *MBB =  MI->getParent();
+  MachineFunction *MF = MBB->getParent();
+  const X86Subtarget &STI = MF->getSubtarget<X86Subtarget>();
+  const X86InstrInfo &TII = *STI.getInstrInfo();
+  DebugLoc DL = MI->getDebugLoc();
+  MachineInstrBuilder MIB;
+  // After the push the source is st(3) or st(4), and the copy is st(0).
+  // After Rotate fincstp the copy is st(8 - Rotate).
+  unsigned int Rotate = (StReg == X86::ST2) ? 3 : 4;
+  unsigned int Copy = (StReg == X86::ST2) ? X86::ST5 : X86::ST4;
+
+  GFreeDEBUG(1,"[!] Found evil:" << *MI);
+  BuildMI(*MBB, MI, DL, TII.get(X86::LD_Frr)).addReg(X86::ST0);
+  for(unsigned int i = 0; i < Rotate; i++)
+    BuildMI(*MBB, MI, DL, TII.get(X86::FINCSTP));
+  MIB = BuildMI(*MBB, MI, DL, TII.get(X86::ST_Frr)).addReg(Copy);
+  GFreeDEBUG(2,"> " << *MIB);
+  for(unsigned int i = 0; i < Rotate; i++)
+    BuildMI(*MBB, MI, DL, TII.get(X86::FDECSTP));
+  ++X87Rotated;
+  return true;
+}
+
 void instructionTransformation(MachineFunction &MF){
   MachineInstr *MI;
   std::vector<MachineInstr*> toDelete; // This hold all the instructions that will be deleted.
@@ -130,6 +223,20 @@ void instructionTransformation(MachineFunction &MF){
 	del = handleMOVNTI(MI);	
       }
 
+      switch(Opc){
+      case X86::ADD_FST0r:  case X86::MUL_FST0r:
+      case X86::ADD_FrST0:  case X86::MUL_FrST0:
+      case X86::ADD_FPrST0: case X86::MUL_FPrST0:
+      case X86::XCH_F:
+      case X86::CMOVB_F:    case X86::CMOVE_F:
+      case X86::CMOVNB_F:   case X86::CMOVNE_F:
+	del = handleX87(MI);
+	break;
+      case X86::LD_Frr:
+	del = handleX87Load(MI);
+	break;
+      }
+
       if (del){
 	toDelete.push_back(MI);
       } 
@@ -141,15 +248,9 @@ void instructionTransformation(MachineFunction &MF){
   }
 }
 
-MachineFunction* branchTargetFunction(MachineInstr *MI){
-  // errs() << "[-] branchTargetFunction: " << *MI;
-  assert("[-] jumpTarget called with a MI that's not a branch!" && MI->isBranch());
-  return MI->getOperand(0).getMBB()->getParent();
-}
-
-
 void insertPrologueOrEpilogue(MachineInstr *MI, unsigned int retAddrRegister, 
-			      unsigned int retAddrOffset, bool Prologue){
+			      unsigned int retAddrOffset, bool Prologue,
+			      std::vector<MachineInstr *> &Sleds){
 
   MachineBasicBlock *MBB =  MI->getParent();
   MachineFunction *MF = MBB->getParent();
@@ -171,30 +272,32 @@ void insertPrologueOrEpilogue(MachineInstr *MI, unsigned int retAddrRegister,
     DL = MI->getDebugLoc();
   }
 
-  MachineOperand r11_def = MachineOperand::CreateReg(X86::R11, true);
-  MachineOperand r11_use = MachineOperand::CreateReg(X86::R11, false);
-
-  // Emit the nopsled if we are emitting the epilogue.
-  if(!Prologue){
-    emitNop(MI, 9);
-  }
+  // Before a tail jump r11 might hold the target or an argument.
+  unsigned int ScratchReg = Prologue ? X86::R11 : getReturnAddressScratchReg(MI);
+  MachineOperand r11_def = MachineOperand::CreateReg(ScratchReg, true);
+  MachineOperand r11_use = MachineOperand::CreateReg(ScratchReg, false);
 
   // mov    %fs:0x28,%r11
   MIB = BuildMI(*MBB, MI, DL, TII.get(X86::MOV64rm)).addOperand(r11_def)
     .addReg(0).addImm(1).addReg(0).addImm(0x28).addReg(X86::FS);
   GFreeDEBUG(2, "> " << *MIB); 	    
 
+  // The epilogue gets a nopsled before the mov (see emitNopSleds).
+  if(!Prologue){
+    Sleds.push_back(MIB);
+  }
+
   // xor %r11, (%rsp)
   MIB = BuildMI(*MBB, MI, DL, TII.get(X86::XOR64mr));
   addRegOffset(MIB, retAddrRegister, false, retAddrOffset);
   MIB.addOperand(r11_use);
   GFreeDEBUG(2, "> " << *MIB); 	    
 
-  MBB->addLiveIn(X86::R11);
+  MBB->addLiveIn(ScratchReg);
   MBB->sortUniqueLiveIns();
 }
 
-void returnAddressProtection(MachineFunction &MF){
+void returnAddressProtection(MachineFunction &MF, std::vector<MachineInstr *> &Sleds){
   GFreeDEBUG(2, "[+---- Return Address Protection @ ----+]\n");
 
   MachineFunction::iterator MBB = MF.begin();
@@ -226,13 +329,14 @@ void returnAddressProtection(MachineFunction &MF){
   for (MBB = MF.begin(), MBBE = MF.end(); MBB != MBBE; ++MBB){
     if(MBB->empty()) continue;
     MI = std::prev(MBB->end());
-    if(MI->isIndirectBranch()){
+    if(MI->isIndirectBranch() && !isTailCall(MI)){
       continue; 
     }
-    if ( ( MI->isReturn() ) ||
-	 ( MI->isBranch() && branchTargetFunction(MI)->getFunctionNumber() != MF.getFunctionNumber() )){
+    // A tail jump (TAILJMP*) is a return too: the return address is
+    // decrypted before it, and the callee's prologue encrypts it again.
+    if ( MI->isReturn() ){
       ++Rap; // update stats/
-      insertPrologueOrEpilogue(MI, retAddrRegister, retAddrOffset, false);	  
+      insertPrologueOrEpilogue(MI, retAddrRegister, retAddrOffset, false, Sleds);	  
       inserted = true;
     }
     if ( (std::next(MBB) == MBBE) && MI->isCall()){ // If the last inst of the last basic block is a call,
@@ -247,13 +351,25 @@ void returnAddressProtection(MachineFunction &MF){
       MBB++;
     }
     MI = MBB->begin();
-    insertPrologueOrEpilogue(MI, retAddrRegister, retAddrOffset, true);
+    insertPrologueOrEpilogue(MI, retAddrRegister, retAddrOffset, true, Sleds);
   }
   return; 
 }
 
 
+// True if MI is the cmp %fs:0x28 of the check cookie routine.
+static bool isCookieCmp(MachineInstr *MI){
+  return MI->getOpcode() == X86::CMP64rm &&
+    MI->getOperand(4).isImm() && MI->getOperand(4).getImm() == 0x28 &&
+    MI->getOperand(5).getReg() == X86::FS;
+}
+
 // This function checks if MI points to the bottom of the check cookie routine.
+// The routine (see X86GFreeJCP.cpp) is either:
+//   mov $cookie, %R; xor (stack), %R; cmp %fs:0x28, %R
+// with a dead scratch register R, or, when there is none, the same with
+// R11 saved around it:
+//   push %r11; mov; xor; cmp; pop %r11
 // It does perform some check and return:
 // -1 if in MBB there will never be the routine we are looking for. The caller should proceed with another MBB.
 //  0 if we found the routine
@@ -262,44 +378,75 @@ int matchCheckCookieRoutine(MachineInstr *MI){
   MachineBasicBlock *ParentMBB = MI->getParent();
   MachineBasicBlock::iterator ParentMIBegin = ParentMBB->begin();
   MachineBasicBlock::iterator tmpMI = MI;
+  bool Saved = tmpMI->getOpcode() == X86::POP64r;
 
-  if(ParentMBB->size() < 5)
-    return -1;
+  if(Saved){
+    if(tmpMI == ParentMIBegin)
+      return -1;
+    tmpMI = std::prev(tmpMI);
+  }
 
-  if( (ParentMIBegin == tmpMI) ||
-      (std::next(ParentMIBegin) == tmpMI))
+  // mov and xor (and push) must fit before the cmp.
+  if(std::distance(ParentMIBegin, tmpMI) < (Saved ? 3 : 2))
     return -1;
 
-  if ((std::prev(tmpMI,4)->getOpcode() == X86::PUSH64r) &&
-      (std::prev(tmpMI,3)->getOpcode() == X86::MOV64ri) &&
-      (std::prev(tmpMI,2)->getOpcode() == X86::XOR64rm) &&
-      (std::prev(tmpMI,1)->getOpcode() == X86::CMP64rm ) &&
-      (tmpMI->getOpcode() == X86::POP64r)             )
+  if (isCookieCmp(tmpMI) &&
+      (std::prev(tmpMI,1)->getOpcode() == X86::XOR64rm) &&
+      (std::prev(tmpMI,2)->getOpcode() == X86::MOV64ri) &&
+      (!Saved || std::prev(tmpMI,3)->getOpcode() == X86::PUSH64r))
     return 0;
 
   return 1;
 }
 
-// This function finalize the cookie for jmp*/call*, and also adds a
-// nop sled before the check..  Finalize means, for every jmp*/call*
+// This function finalize the cookie for jmp*/call*, and also records
+// the check for a nop sled.  Finalize means, for every jmp*/call*
 // go backwards and find the block of instructions inserted from
 // X86GFreeJCP.cpp that check the cookie. Bring them down, close to
 // the jmp*/call*.
-// Also, splice the MBB, put a jump and an hlt between the check and the
-// jmp*/call* so the layout will be:
+// Also, splice the MBB and put a jump to a shared trap block
+// between the check and the jmp*/call*, so the layout will be:
 
 // check_cookie;
-// je; -----------|
-// hlt;           |
-// jmp*/call*; <--|
+// jne; ----------|
+// jmp*/call*;    |
+// ...            |
+// hlt; <---------|  (after the first block that can't fall through)
 // 
+// The jne must stay short (see localizeFarTraps).
 
 // This is a sample of the code for checking the cookie: 
 // > %vreg25<def> = MOV64rm <fi#0>, 1, %noreg, 0, %noreg; mem:LD8[FixedStack0] GR64:%vreg25
 // > %vreg26<def,tied1> = XOR64ri32 %vreg25<tied0>, 179027149, %EFLAGS<imp-def>; GR64:%vreg26,%vreg25
 // > CMP64rm %vreg26, %noreg, 1, %noreg, 40, %FS, %EFLAGS<imp-def>; GR64:%vreg26
 
-void cookieProtectionFinalization(MachineFunction &MF){
+// The trap block for a check that falls through to From: right after the
+// first block from From on that can't fall through, out of the hot path and
+// as close as it gets. The checks nearby share it.
+static MachineBasicBlock *getTrapBlock(MachineBasicBlock *From, DebugLoc DL,
+				       SmallPtrSetImpl<MachineBasicBlock *> &Traps){
+  MachineFunction *MF = From->getParent();
+  const X86InstrInfo &TII = *MF->getSubtarget<X86Subtarget>().getInstrInfo();
+  MachineFunction::iterator I = From->getIterator();
+  // The last block can't fall through.
+  while(!Traps.count(&*I) && I->canFallThrough())
+    ++I;
+  if(Traps.count(&*I))
+    return &*I;
+  MachineFunction::iterator Next = std::next(I);
+  if(Next != MF->end() && Traps.count(&*Next))
+    return &*Next;
+
+  MachineBasicBlock *TrapMBB = MF->CreateMachineBasicBlock();
+  MF->insert(Next, TrapMBB);
+  BuildMI(*TrapMBB, TrapMBB->end(), DL, TII.get(X86::HLT));
+  Traps.insert(TrapMBB);
+  ++TrapBlocks;
+  return TrapMBB;
+}
+
+void cookieProtectionFinalization(MachineFunction &MF, std::vector<MachineInstr *> &Sleds,
+				  std::vector<MachineInstr *> &TrapJumps){
   GFreeDEBUG(2, "\n[+---- Jump Control Protection Finalization  ----+]\n");
   const X86Subtarget &STI = MF.getSubtarget<X86Subtarget>();
   const X86InstrInfo &TII = *STI.getInstrInfo();
@@ -308,6 +455,9 @@ void cookieProtectionFinalization(MachineFunction &MF){
   MachineInstrBuilder  MIB;
   MachineInstr *MI;
   std::vector<llvm::MachineInstr*> alreadyCheckedInstr;
+  // Shared by the nearby checks. The failing branch is forward so it's
+  // statically predicted not taken.
+  SmallPtrSet<MachineBasicBlock *, 4> Traps;
 
   for (MBB = MF.begin(), MBBE = MF.end(); 
        MBB != MBBE; ++MBB){
@@ -331,67 +481,43 @@ void cookieProtectionFinalization(MachineFunction &MF){
       alreadyCheckedInstr.push_back(MI);
 
       // Do it nicely.
-      MachineBasicBlock *newMBB = MF.CreateMachineBasicBlock();
-      MachineBasicBlock *hltMBB = MF.CreateMachineBasicBlock();
-	
-      MF.insert(MBB, hltMBB);
-      MF.insert(MBB, newMBB);
-      newMBB->moveAfter(&*MBB); 
-      hltMBB->moveAfter(&*MBB);   
-	
-      MIB = BuildMI(*hltMBB, hltMBB->begin(), 
-		    hltMBB->begin()->getDebugLoc(), TII.get(X86::HLT));
-	
-      newMBB->splice(newMBB->begin(), &*MBB, MI, MBB->end());
-	
-      newMBB->transferSuccessorsAndUpdatePHIs(&*MBB);
-      MBB->addSuccessor(hltMBB);
-      MBB->addSuccessor(newMBB);
-	
-      DebugLoc DL = newMBB->begin()->getDebugLoc();
-      MIB = BuildMI(*MBB, MBB->end(), DL, TII.get(X86::JE_1)).addMBB(newMBB); 
-      MBB->addLiveIn(X86::EFLAGS);
-      GFreeDEBUG(1, "> " << *MIB);
-      
-      MachineBasicBlock::iterator tmpMI = std::prev(MBB->end()); // JE_1
-      MachineFunction::iterator tmpMBB = MBB; 
+      DebugLoc DL = MI->getDebugLoc();
 
-      // If the cookie check routine is not before JE, than
-      // go backwards and push it down!
-      if((MBB->size() < 6) ||
-	 matchCheckCookieRoutine(std::prev(tmpMI)) != 0){ 	
-	GFreeDEBUG(2, "[!] Look for the check block and push it down\n");
-	int status;
-	do{
-	  status = matchCheckCookieRoutine(tmpMI);
-	  if(status == -1){ // We scanned all the block but llvm folded the indirect call in a new MBB.
-	    GFreeDEBUG(2, "[!] Branch was folded. ");
-	    GFreeDEBUG(2, "Starting to look our instructions from the end of prev of MBB#" << (tmpMBB)->getNumber() << "\n");
-	    tmpMBB = std::prev(tmpMBB);
-	    tmpMI= std::prev(tmpMBB->end());
-	  }
-	  if(status == 1){
-	    tmpMI=std::prev(tmpMI);
-	  }
-	}while(status != 0);
-      }
-      else{ // The check routine was not moved, and prev(tmpMI) is pop
-	tmpMI = std::prev(tmpMI);
-      }
+      // Look for the check routine, going backwards from MI.
+      MachineBasicBlock::iterator tmpMI = MI;
+      MachineFunction::iterator tmpMBB = MBB; 
+      int status;
+      do{
+	status = matchCheckCookieRoutine(tmpMI);
+	if(status == -1){ // We scanned all the block but llvm folded the indirect call in a new MBB.
+	  GFreeDEBUG(2, "[!] Branch was folded. ");
+	  GFreeDEBUG(2, "Starting to look our instructions from the end of prev of MBB#" << (tmpMBB)->getNumber() << "\n");
+	  tmpMBB = std::prev(tmpMBB);
+	  tmpMI= std::prev(tmpMBB->end());
+	}
+	if(status == 1){
+	  tmpMI=std::prev(tmpMI);
+	}
+      }while(status != 0);
       
-      MachineInstr *PushMI = std::prev(tmpMI,4);
-      MachineInstr *MovMI = std::prev(tmpMI,3); // MOV
-      MachineInstr *XorMI = std::prev(tmpMI,2); // XOR
-      MachineInstr *CmpMI = std::prev(tmpMI,1); // CMP
-      MachineInstr *PopMI = std::prev(tmpMI,0); // CMP
-
-      GFreeDEBUG(2, "[GF] From here: \n" << *PushMI << *MovMI  << *XorMI << *CmpMI << *PopMI
-      		 << "[GF] Move down, close to the JMP\n");
+      // tmpMI is the pop if R11 was saved, the cmp otherwise.
+      bool Saved = tmpMI->getOpcode() == X86::POP64r;
+      MachineBasicBlock::iterator CheckBegin = std::prev(tmpMI, Saved ? 4 : 2);
+      MachineBasicBlock::iterator MovIt = Saved ? std::next(CheckBegin) : CheckBegin;
+      MachineInstr *MovMI = MovIt;               // MOV
+      MachineInstr *XorMI = std::next(MovIt, 1); // XOR
+      MachineInstr *CmpMI = std::next(MovIt, 2); // CMP
+      std::vector<MachineInstr *> CheckMIs;
+      for(MachineBasicBlock::iterator I = CheckBegin; I != std::next(tmpMI); ++I)
+	CheckMIs.push_back(I);
+
+      GFreeDEBUG(2, "[GF] From here: \n");
+      for(MachineInstr *CheckMI : CheckMIs)
+	GFreeDEBUG(2, *CheckMI);
 
       MachineOperand &CmpDestReg = CmpMI->getOperand(0);
       MachineOperand &CmpBaseReg = XorMI->getOperand(2);
       MachineOperand &CmpDisplacement = XorMI->getOperand(5);
-      MachineBasicBlock::iterator insertPoint = std::prev(MBB->end());
 	  
       assert(CmpDestReg.isReg() && "Is should be a register!");
       assert(CmpBaseReg.isReg() &&		 
@@ -399,48 +525,174 @@ void cookieProtectionFinalization(MachineFunction &MF){
 	     "Displacement is not immediate in X86GFree.cpp");
 
       // If the cookie is referenced with RSP, we have to add 8 to the displacement because of the push.
-      int offsetAdjustment = CmpBaseReg.getReg() == X86::RSP ? +8 : 0;
+      int offsetAdjustment = (Saved && CmpBaseReg.getReg() == X86::RSP) ? +8 : 0;
       CmpDisplacement.setImm(CmpDisplacement.getImm() + offsetAdjustment);
 
-      PushMI->removeFromParent();
-      PushMI->setDebugLoc(DL);
-      MBB->insert(insertPoint, PushMI);
+      // The block is split where the jne goes, usually right before MI.
+      MachineBasicBlock *SplitMBB = &*MBB;
+      MachineBasicBlock::iterator SplitPoint = MI;
 
-      MovMI->removeFromParent();
-      MovMI->setDebugLoc(DL);
-      MBB->insert(insertPoint, MovMI);
-
-      XorMI->removeFromParent();
-      XorMI->setDebugLoc(DL);
-      MBB->insert(insertPoint, XorMI);
+      // Before a tail jump the epilogue is between the check and MI, and
+      // the cookie slot is gone after it.
+      if(isTailCall(MI) && !Saved){
+	// Only the cmp goes down: the scratch register survives the epilogue
+	// and the return address decryption (see X86GFreeJCP.cpp).
+	CheckMIs.assign(1, CmpMI);
+      }
+      else if(isTailCall(MI)){
+	// r11 is popped before the epilogue, which clobbers the flags: the
+	// check stays where it is and the jne goes right after the pop.
+	SplitMBB = tmpMI->getParent();
+	SplitPoint = std::next(tmpMI);
+	CheckMIs.clear();
+      }
 
-      CmpMI->removeFromParent();
-      CmpMI->setDebugLoc(DL);
-      MBB->insert(insertPoint, CmpMI);
+      MachineBasicBlock *newMBB = MF.CreateMachineBasicBlock();
+      MF.insert(std::next(SplitMBB->getIterator()), newMBB);
+	
+      newMBB->splice(newMBB->begin(), SplitMBB, SplitPoint, SplitMBB->end());
+	
+      newMBB->transferSuccessorsAndUpdatePHIs(SplitMBB);
+      MachineBasicBlock *TrapMBB = getTrapBlock(newMBB, DL, Traps);
+      SplitMBB->addSuccessor(TrapMBB, BranchProbability::getZero());
+      SplitMBB->addSuccessor(newMBB, BranchProbability::getOne());
+	
+      MIB = BuildMI(*SplitMBB, SplitMBB->end(), DL, TII.get(X86::JNE_1)).addMBB(TrapMBB); 
+      SplitMBB->addLiveIn(X86::EFLAGS);
+      TrapJumps.push_back(MIB);
+      GFreeDEBUG(1, "> " << *MIB);
 
-      PopMI->removeFromParent();
-      PopMI->setDebugLoc(DL);
-      MBB->insert(insertPoint, PopMI);
+      if(!CheckMIs.empty())
+	GFreeDEBUG(2, "[GF] Move down, close to the JMP\n");
+      MachineBasicBlock::iterator insertPoint = std::prev(SplitMBB->end());
+      for(MachineInstr *CheckMI : CheckMIs){
+	CheckMI->removeFromParent();
+	CheckMI->setDebugLoc(DL);
+	SplitMBB->insert(insertPoint, CheckMI);
+      }
 
-      emitNop(MovMI, 9);
+      // The sled is sized after all the code motion (see emitNopSleds).
+      Sleds.push_back(MovMI);
 
       GFreeDEBUG(3, "[GF] After splitting: \n" <<
-		    " MBB: "    << *MBB        <<
-		    " newMBB: " << *newMBB     <<
-		    " hltMBB: " << *hltMBB     );
+		    " MBB: "    << *SplitMBB   <<
+		    " newMBB: " << *newMBB     );
       break;
     }
   }
 }
 
+// Emits the nop sleds before the instructions in Sleds. They are sized
+// on the bytes before them, so this runs after everything else moved
+// code around, and in layout order: a sled is part of the bytes before
+// the next one.
+void emitNopSleds(MachineFunction &MF, GFreeSyncAnalysis &Sync,
+		  const std::vector<MachineInstr *> &Sleds){
+  if(Sleds.empty())
+    return;
+  SmallPtrSet<MachineInstr *, 16> Sites(Sleds.begin(), Sleds.end());
+  for(MachineBasicBlock &MBB : MF)
+    for(MachineInstr &MI : MBB)
+      if(Sites.count(&MI))
+	emitNopSled(&MI, Sync.getSledLength(&MI, 9));
+}
+
+// An upper bound of the size of MI, Enc has the exact one if it was
+// encodable.
+static unsigned int getSizeBound(const MachineInstr &MI, const GFreeEncodedBytes &Enc){
+  if(MI.isDebugValue() || MI.isCFIInstruction() || MI.isKill() ||
+     MI.isImplicitDef() || MI.isLabel())
+    return 0;
+  // The direct branches are relaxed by the assembler: jcc rel32.
+  if(MI.isBranch() && !MI.isIndirectBranch())
+    return 6;
+  if(Enc.isEncoded(&MI))
+    return Enc.getSize(&MI);
+  return 15;
+}
+
+// A jne to a shared trap is a rel32 when the trap is more than 127 bytes
+// away, and its displacement might have a c2/c3/ca/cb in it (0f 85 c3 00
+// 00 00). A forward rel8 never does. The checks whose trap might be that
+// far get back a local one:
+// 
+// check_cookie;
+// je; -----------|
+// hlt;           |
+// jmp*/call*; <--|
+// 
+// The sizes are upper bounds (see getSizeBound) and a local trap makes
+// the others farther, so it runs until nothing changes.
+void localizeFarTraps(MachineFunction &MF, std::vector<MachineInstr *> &TrapJumps,
+		      std::unique_ptr<GFreeAssembler> &AssemblerContext){
+  if(TrapJumps.empty())
+    return;
+  const X86Subtarget &STI = MF.getSubtarget<X86Subtarget>();
+  const X86InstrInfo &TII = *STI.getInstrInfo();
+  // The encoding context adds a temporary block to MF, drop it before
+  // changing the layout.
+  GFreeEncodedBytes Enc;
+  GFreeAssembler *Assembler = getGFreeAssembler(AssemblerContext, MF);
+  Assembler->encodeFunction(MF, Enc);
+  Assembler->release();
+
+  bool Changed;
+  do{
+    Changed = false;
+    for(auto JI = TrapJumps.begin(); JI != TrapJumps.end(); ){
+      MachineInstr *JNE = *JI;
+      MachineBasicBlock *MBB = JNE->getParent();
+      MachineBasicBlock *TrapMBB = JNE->getOperand(0).getMBB();
+      unsigned int Distance = 0;
+      MachineFunction::iterator I = std::next(MBB->getIterator());
+      for(; I != MF.end() && &*I != TrapMBB && Distance < 128; ++I){
+	Distance += (1U << I->getAlignment()) - 1;
+	for(const MachineInstr &MI : *I)
+	  Distance += getSizeBound(MI, Enc);
+      }
+      if(I != MF.end() && &*I == TrapMBB)
+	Distance += (1U << TrapMBB->getAlignment()) - 1;
+      if(I != MF.end() && &*I == TrapMBB && Distance < 128){
+	++JI;
+	continue;
+      }
+
+      GFreeDEBUG(1, "[GF] Trap too far for " << *JNE);
+      MachineBasicBlock *FallThrough = &*std::next(MBB->getIterator());
+      MachineBasicBlock *LocalTrap = MF.CreateMachineBasicBlock();
+      MF.insert(FallThrough->getIterator(), LocalTrap);
+      BuildMI(*LocalTrap, LocalTrap->end(), JNE->getDebugLoc(), TII.get(X86::HLT));
+      BuildMI(*MBB, JNE, JNE->getDebugLoc(), TII.get(X86::JE_1)).addMBB(FallThrough);
+      JNE->eraseFromParent();
+      MBB->replaceSuccessor(TrapMBB, LocalTrap);
+      if(TrapMBB->pred_empty()){
+	MF.erase(TrapMBB);
+	--TrapBlocks;
+      }
+      ++LocalTraps;
+      JI = TrapJumps.erase(JI);
+      Changed = true;
+    }
+  }while(Changed);
+}
+
 // Main.
 bool GFreeMachinePass::runOnMachineFunction(MachineFunction &MF) {
   if(MF.empty())
     return true;
 
-  returnAddressProtection(MF);
-  cookieProtectionFinalization(MF);
+  // The transformations first: the sleds are sized on the final bytes.
   instructionTransformation(MF); 
+  if(!Disasm)
+    Disasm = GFreeSyncAnalysis::createDisassembler(MF);
+  std::vector<MachineInstr *> Sleds;
+  std::vector<MachineInstr *> TrapJumps;
+  returnAddressProtection(MF, Sleds);
+  cookieProtectionFinalization(MF, Sleds, TrapJumps);
+  GFreeSyncAnalysis Sync(MF, Disasm.get(), AssemblerContext);
+  emitNopSleds(MF, Sync, Sleds);
+  // Last: the sleds are part of the distances.
+  localizeFarTraps(MF, TrapJumps, AssemblerContext);
 
   return true;
 
@@ -6,64 +6,118 @@
 //
 //===----------------------------------------------------------------------===//
 //
-// This file contains code to XXXXXX.
+// This file contains code to assemble a single MachineInstr (or a whole
+// MachineBasicBlock / MachineFunction) into bytes, before the final code
+// emission.
 //
 //===----------------------------------------------------------------------===//
 
 #include <X86GFreeAssembler.h>
+#include "llvm/ADT/Statistic.h"
+#include "llvm/Support/Process.h"
 
 
 using namespace llvm;
 
+#define DEBUG_TYPE "gfreeassembler"
+STATISTIC(AssemblerCreated, "Number of GFree encoding contexts created");
+STATISTIC(AssemblerReused , "Number of GFree encoding contexts reused across functions");
+STATISTIC(AssemblerKBSaved, "Heap (in KB) not allocated by reusing the GFree encoding contexts");
+STATISTIC(BatchEncodedInstrs, "Number of instructions encoded by the batch encoder");
+
+static cl::opt<bool> GFreeNoAssemblerPool("gfree-no-assembler-pool", cl::Hidden,
+	       cl::desc("Create a new GFree encoding context for every function"));
+
 GFreeAssembler::GFreeAssembler(MachineFunction &MF, VirtRegMap *VRMap){
-  VRM=VRMap;
+  NamedRegionTimer T("Encoding context setup", "GFree encoding context",
+		     TimePassesIsEnabled);
+  ++AssemblerCreated;
+  CurMF = nullptr;
+  tmpMBB = nullptr;
   STI = &MF.getSubtarget();
-  TII = MF.getSubtarget().getInstrInfo();
-  TRI = MF.getSubtarget().getRegisterInfo();
-
-  // Create a temp MachineBasicBlock at the end of this function.  
-  tmpMBB = MF.CreateMachineBasicBlock();
-  MF.insert(MF.end(), tmpMBB);
+  size_t HeapBefore = sys::Process::GetMallocUsage();
 
   const TargetMachine &TM = MF.getTarget();
   const Target &T = TM.getTarget();
   
-  // Let's create a MCCodeEmitter
+  // Let's create a MCCodeEmitter. The MCContext is owned by the
+  // MachineModuleInfo, so it lives as long as the module.
   CodeEmitter.reset(T.createMCCodeEmitter(
        *MF.getSubtarget().getInstrInfo(), 
        *MF.getSubtarget().getRegisterInfo(),
        MF.getContext() 			  ));
 
-  // NullStreamer->reset(S);
-
-  // let's create a TargetMachine for AsmPrinter
-  // tmpTM = T.createTargetMachine(
-  // 				TM.getTargetTriple(),
-  // 				TM.getTargetCPU(),
-  // 				TM.getTargetFeatureString(),
-  // 				TM.Options);
-  // const TargetMachine &tmpTM = MF.getTarget();
-
   // Let's create a (null) MCStreamer for AsmPrinter
   MCStreamer *NullStreamer = T.createNullStreamer(MF.getContext());
 
-  // Let's create a X86AsmPrinter for MCInstLower
-  std::unique_ptr<TargetMachine> tmpTM;
+  // Let's create a X86AsmPrinter for MCInstLower. The TargetMachine must
+  // outlive the printer, so we keep it around.
   tmpTM.reset(T.createTargetMachine(TM.getTargetTriple().getTriple(),
 				 TM.getTargetCPU(),
 				 TM.getTargetFeatureString(),
 				 TM.Options));
 
-  Printer = static_cast<X86AsmPrinter*>(T.createAsmPrinter(*tmpTM, std::unique_ptr<MCStreamer>(NullStreamer)));  
+  Printer.reset(static_cast<X86AsmPrinter*>(T.createAsmPrinter(*tmpTM, std::unique_ptr<MCStreamer>(NullStreamer))));
+
+  // What every reuse saves: the per-function state is not counted.
+  size_t HeapAfter = sys::Process::GetMallocUsage();
+  ContextBytes = HeapAfter > HeapBefore ? HeapAfter - HeapBefore : 0;
+  GFreeDEBUG(2, "[ASM] Encoding context: " << ContextBytes << " bytes\n");
+  reset(MF, VRMap);
+}
+
+bool GFreeAssembler::isCompatible(const MachineFunction &MF) const{
+  return STI == &MF.getSubtarget() && Printer &&
+    &Printer->OutContext == &MF.getContext();
+}
+
+void GFreeAssembler::release(){
+  // 6b.
+  if(tmpMBB != nullptr){
+    tmpMBB->erase(tmpMBB->begin(), tmpMBB->end());
+    tmpMBB->eraseFromParent();
+  }
+  tmpMBB = nullptr;
+  MCInstLower.reset();
+  CurMF = nullptr;
+}
+
+void GFreeAssembler::reset(MachineFunction &MF, VirtRegMap *VRMap){
+  VRM=VRMap;
+  if(CurMF == &MF)
+    return;
+
+  release();
+  CurMF = &MF;
+  STI = &MF.getSubtarget();
+  TII = MF.getSubtarget().getInstrInfo();
+  TRI = MF.getSubtarget().getRegisterInfo();
+
+  // Create a temp MachineBasicBlock at the end of this function.  
+  tmpMBB = MF.CreateMachineBasicBlock();
+  MF.insert(MF.end(), tmpMBB);
+
   Printer->setSubtarget(&MF.getSubtarget<X86Subtarget>());
   // Finally(!) create an X86MCInstLower object.
-  MCInstLower = new X86MCInstLower(MF, *Printer);
+  MCInstLower.reset(new X86MCInstLower(MF, *Printer));
 }
 
 GFreeAssembler::~GFreeAssembler(){
-  // 6b.
-  tmpMBB->erase(tmpMBB->begin(), tmpMBB->end());
-  tmpMBB->eraseFromParent();
+  release();
+}
+
+GFreeAssembler *llvm::getGFreeAssembler(std::unique_ptr<GFreeAssembler> &Context,
+					MachineFunction &MF, VirtRegMap *VRMap){
+  if(Context && !GFreeNoAssemblerPool && Context->isCompatible(MF)){
+    if(Context->CurMF != &MF){
+      ++AssemblerReused;
+      AssemblerKBSaved += Context->ContextBytes / 1024;
+    }
+    Context->reset(MF, VRMap);
+    return Context.get();
+  }
+  Context.reset(new GFreeAssembler(MF, VRMap));
+  return Context.get();
 }
 
 void GFreeAssembler::temporaryRewriteRegister(MachineInstr *MI){
@@ -114,9 +168,10 @@ bool GFreeAssembler::LowerCopy(MachineInstr *MI) {
   MachineOperand &DstMO = MI->getOperand(0);
   MachineOperand &SrcMO = MI->getOperand(1);
 
-  // For now we don't support floating point instructions.
-  if(DstMO.getReg() == X86::FP0 || DstMO.getReg() == X86::FP1 || DstMO.getReg() == X86::FP2 || DstMO.getReg() == X86::FP3 ||
-     DstMO.getReg() == X86::FP4 || DstMO.getReg() == X86::FP5 || DstMO.getReg() == X86::FP6 || DstMO.getReg() == X86::FP7 )
+  // The x87 copies (and every FP0-FP7 pseudo) become fld/fxch/fstp st(i)
+  // in the FP stackifier, their encoding is not known yet. The evil ones
+  // are fixed after the stackifier (see handleX87 in X86GFree.cpp).
+  if(X86::RFP80RegClass.contains(DstMO.getReg()) || X86::RFP80RegClass.contains(SrcMO.getReg()))
     return false;
   
   if (MI->allDefsAreDead() ||
@@ -187,11 +242,36 @@ bool GFreeAssembler::expandPseudo(MachineInstr *MI){
   return Changed;
 }
 
+// Expand tmpMI (if it's a pseudo) in place and append the bytes of every
+// resulting instruction. The expansion inserts the new instructions before
+// tmpMI, so we remember what's before it: the range from there to the
+// instruction after tmpMI is the expansion.
+void GFreeAssembler::expandAndEncode(MachineInstr *tmpMI, std::vector<unsigned char> &Bytes){
+  MachineBasicBlock::iterator Next = std::next(MachineBasicBlock::iterator(tmpMI));
+  bool AtBegin = MachineBasicBlock::iterator(tmpMI) == tmpMBB->begin();
+  MachineBasicBlock::iterator Prev = AtBegin ? tmpMBB->end() : std::prev(MachineBasicBlock::iterator(tmpMI));
+
+  // 3. We could be before the ExpandPostRAPseudos pass, so we need to expand
+  // some pseudos.
+  if(tmpMI->isPseudo() && !expandPseudo(tmpMI)) // Nothing to encode.
+    return;
+
+  // 4. Lower and Encode all the instructions of the expansion.
+  MachineBasicBlock::iterator First = AtBegin ? tmpMBB->begin() : std::next(Prev);
+  for(MachineBasicBlock::iterator I = First; I != Next; ++I){
+    if(I->isPseudo()) // i.e. a KILL left by the expansion.
+      continue;
+    GFreeDEBUG(3, "[A] MI rewrited-expanded       : " << *I);
+    std::vector<unsigned char> MIbytes = lowerEncodeInstr(I);
+    Bytes.insert(Bytes.end(), MIbytes.begin(), MIbytes.end());
+  }
+}
+
 // Here's the plan:
 // 1) Clone and insert MI into a tmp MBB (otherwise we can't lower pseudos)
 // 2) Fake-allocation of registers
 // 3) if MI is pseudo, expand it;
-// 4) lower MI to MCInst and assemble
+// 4) lower every resulting instruction to MCInst and assemble
 // 6a) delete the lowered-expandend-regallocated MI
 // 6b) at the end delete the parent tmpMBB so the function is not altered.
 
@@ -201,7 +281,7 @@ std::vector<unsigned char> GFreeAssembler::MachineInstrToBytes(MachineInstr *MI)
   std::vector<unsigned char> bytes;
   // 1. Clone MI into a new instruction and insert into the temp MBB.
   MachineInstr* tmpMI = MF->CloneMachineInstr(MI);  
-  tmpMBB->insertAfter(tmpMBB->begin(), tmpMI);
+  tmpMBB->push_back(tmpMI);
   
   // 2. Temporary rewrite the registers.
   if(VRM != nullptr){
@@ -210,33 +290,78 @@ std::vector<unsigned char> GFreeAssembler::MachineInstrToBytes(MachineInstr *MI)
 
   GFreeDEBUG(3, "[A] MI reg-rewrited            : " << *tmpMI);
   
-  // 3. We could be before the ExpandPostRAPseudos pass, so we need to expand
-  // some pseudos.
-  if(tmpMI->isPseudo()){
-    if(!expandPseudo(tmpMI) ){ // If we didn't expanded, return empty array.
-      goto exit;
-    }
-    tmpMI = tmpMBB->begin();
-  }
-  GFreeDEBUG(3, "[A] MI rewrited-expanded       : " << *tmpMI);
-  // 4. Lower and Encode MI.
-  bytes = lowerEncodeInstr(tmpMI);
-  GFreeDEBUG(3, "[A] MI rewrited-expaned-lowered: " << *tmpMI);
+  // 3. 4. Expand, lower and encode MI.
+  expandAndEncode(tmpMI, bytes);
   GFreeDEBUG(3, "[A] MI assembled               : [ ");
   for ( unsigned char c: bytes)
     GFreeDEBUG(3, format("%02x", c));
   GFreeDEBUG(3," ]\n");
 
- exit:
   // 6a. Empty the MBB.
   tmpMBB->erase(tmpMBB->begin(), tmpMBB->end());
   return bytes;
+}
 
-  // [FIXME]: Since the pseudo expansion could produce more than 1 istruction,
-  // we should process all of them, while now we process just the first.  Uncomment
-  // this and clang -O2 diff-O3-file6GGqDq.c 
-  
-  // assert(tmpMBB->empty() && "tmpMBBis not empty!");
-  
+bool GFreeAssembler::isEncodable(const MachineInstr &MI){
+  if(MI.isReturn() || MI.isCall() || MI.isIndirectBranch() ||
+     MI.isDebugValue() || MI.isLabel() || MI.isCFIInstruction() ||
+     MI.isInlineAsm() || MI.isKill() || MI.isImplicitDef())
+    return false;
+  // Frame indexes, symbols, MBBs.. can't be lowered (yet).
+  for(const MachineOperand &MO : MI.operands()){
+    if(!MO.isReg() && !MO.isImm())
+      return false;
+  }
+  return true;
+}
+
+// Same steps of MachineInstrToBytes, but every step is done on the whole
+// range at once: tmpMBB is filled and emptied only once.
+void GFreeAssembler::encodeRange(MachineBasicBlock::iterator Begin, MachineBasicBlock::iterator End,
+				 GFreeEncodedBytes &Enc, std::function<bool(const MachineInstr&)> Filter){
+  std::vector<std::pair<const MachineInstr*, MachineInstr*>> Clones;
+  // 1. 2. Clone and rewrite.
+  for(MachineBasicBlock::iterator I = Begin; I != End; ++I){
+    if(!isEncodable(*I) || (Filter && !Filter(*I)))
+      continue;
+    MachineInstr* tmpMI = CurMF->CloneMachineInstr(I);
+    tmpMBB->push_back(tmpMI);
+    if(VRM != nullptr)
+      temporaryRewriteRegister(tmpMI);
+    Clones.push_back(std::make_pair(&*I, tmpMI));
+  }
+
+  // 3. 4. Expand and encode, in order.
+  for(auto &Clone : Clones){
+    unsigned int Offset = Enc.Bytes.size();
+    expandAndEncode(Clone.second, Enc.Bytes);
+    Enc.Offsets[Clone.first] = std::make_pair(Offset, (unsigned int)Enc.Bytes.size() - Offset);
+    ++BatchEncodedInstrs;
+  }
+
+  // 6a. Empty the MBB.
+  tmpMBB->erase(tmpMBB->begin(), tmpMBB->end());
+}
+
+void GFreeAssembler::encodeBasicBlock(MachineBasicBlock &MBB, GFreeEncodedBytes &Enc,
+				      std::function<bool(const MachineInstr&)> Filter){
+  assert(&MBB != tmpMBB && "Can't encode the temporary MBB");
+  encodeRange(MBB.begin(), MBB.end(), Enc, Filter);
 }
 
+void GFreeAssembler::encodeFunction(MachineFunction &MF, GFreeEncodedBytes &Enc,
+				    std::function<bool(const MachineInstr&)> Filter){
+  assert(&MF == CurMF && "The encoding context is bound to another function");
+  for(MachineBasicBlock &MBB : MF){
+    if(&MBB != tmpMBB)
+      encodeRange(MBB.begin(), MBB.end(), Enc, Filter);
+  }
+}
+
+std::vector<unsigned char> GFreeEncodedBytes::getBytes(const MachineInstr *MI) const{
+  auto It = Offsets.find(MI);
+  if(It == Offsets.end())
+    return std::vector<unsigned char>();
+  return std::vector<unsigned char>(Bytes.begin() + It->second.first,
+				    Bytes.begin() + It->second.first + It->second.second);
+}
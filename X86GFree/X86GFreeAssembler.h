@@ -6,31 +6,87 @@
 #include "llvm/CodeGen/MachineInstr.h"
 #include "llvm/Support/raw_ostream.h"
 #include "llvm/Support/TargetRegistry.h"
+#include "llvm/Support/Timer.h"
 #include "llvm/CodeGen/MachineRegisterInfo.h"
 #include "llvm/CodeGen/VirtRegMap.h"
+#include "llvm/ADT/DenseMap.h"
 #include "X86GFreeUtils.h"
+#include <functional>
 namespace llvm {
+  // The bytes of a sequence of instructions (a MBB or a whole function),
+  // with the offset and size of the encoding of each instruction. Only the
+  // encoded instructions are in the buffer (see GFreeAssembler::isEncodable).
+  class GFreeEncodedBytes {
+  public:
+    std::vector<unsigned char> Bytes;
+    DenseMap<const MachineInstr*, std::pair<unsigned int, unsigned int>> Offsets;
+
+    bool isEncoded(const MachineInstr *MI) const { return Offsets.count(MI); }
+    unsigned int getOffset(const MachineInstr *MI) const { return Offsets.lookup(MI).first; }
+    unsigned int getSize(const MachineInstr *MI) const { return Offsets.lookup(MI).second; }
+    std::vector<unsigned char> getBytes(const MachineInstr *MI) const;
+    // True if there's a ret anywhere in the buffer, also across instructions.
+    bool hasRet() const { return containsRet(Bytes); }
+    void clear() { Bytes.clear(); Offsets.clear(); }
+  };
+
+  // The assembler is split in two parts:
+  // - the encoding context (TargetMachine, null streamer, X86AsmPrinter,
+  //   MCCodeEmitter) which depends only on the subtarget, so it is created
+  //   once and reused across all the functions of a module;
+  // - the per-function state (X86MCInstLower, tmpMBB, VRM) which is rebound
+  //   with reset() every time we move to a new MachineFunction.
   class LLVM_LIBRARY_VISIBILITY GFreeAssembler{
   public:
     std::unique_ptr<MCCodeEmitter> CodeEmitter;
-    MCStreamer *S;
-    X86AsmPrinter *Printer;
-    X86MCInstLower *MCInstLower;
+    std::unique_ptr<TargetMachine> tmpTM;
+    std::unique_ptr<X86AsmPrinter> Printer;
+    std::unique_ptr<X86MCInstLower> MCInstLower;
     const MCSubtargetInfo *STI;
     const TargetRegisterInfo *TRI;
     const TargetInstrInfo *TII;
+    MachineFunction *CurMF;
     MachineBasicBlock *tmpMBB;
     VirtRegMap *VRM;
+    // Heap allocated by the encoding context (0 if the platform doesn't
+    // tell), what a reuse saves.
+    size_t ContextBytes;
 
     void temporaryRewriteRegister(MachineInstr *MI);
     std::vector<unsigned char> lowerEncodeInstr(MachineInstr *RegRewMI);
     bool expandPseudo(MachineInstr *MI);
     bool LowerSubregToReg(MachineInstr *MI);
     bool LowerCopy(MachineInstr *MI);
+    void expandAndEncode(MachineInstr *tmpMI, std::vector<unsigned char> &Bytes);
+    void encodeRange(MachineBasicBlock::iterator Begin, MachineBasicBlock::iterator End,
+		     GFreeEncodedBytes &Enc, std::function<bool(const MachineInstr&)> Filter);
 
     GFreeAssembler(MachineFunction &MF, VirtRegMap *VRMap=nullptr);
+    // Rebind the per-function state to MF. The encoding context is kept.
+    void reset(MachineFunction &MF, VirtRegMap *VRMap=nullptr);
+    // Remove tmpMBB from the current function (if any).
+    void release();
+    // True if this context can encode instructions of MF.
+    bool isCompatible(const MachineFunction &MF) const;
     std::vector<unsigned char> MachineInstrToBytes(MachineInstr *MI);
+    // Batch versions of MachineInstrToBytes: every instruction is cloned in
+    // tmpMBB once, and the pseudos are fully expanded. Filter (if any)
+    // selects the instructions to encode, among the encodable ones.
+    void encodeBasicBlock(MachineBasicBlock &MBB, GFreeEncodedBytes &Enc,
+			  std::function<bool(const MachineInstr&)> Filter = nullptr);
+    void encodeFunction(MachineFunction &MF, GFreeEncodedBytes &Enc,
+			std::function<bool(const MachineInstr&)> Filter = nullptr);
+    // Instructions we can lower before the final emission: only register and
+    // immediate operands. Rets, calls and indirect branches are left to the
+    // RAP and JCP protections.
+    static bool isEncodable(const MachineInstr &MI);
     ~GFreeAssembler();
   };
 
+  // Returns the encoding context for MF in Context, creating it the first
+  // time and reusing it afterwards (as long as the subtarget does not
+  // change). Context belongs to the calling pass, which frees it in
+  // doFinalization: nothing is shared between passes or threads.
+  GFreeAssembler *getGFreeAssembler(std::unique_ptr<GFreeAssembler> &Context,
+				    MachineFunction &MF, VirtRegMap *VRMap=nullptr);
 }
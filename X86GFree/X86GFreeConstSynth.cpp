@@ -0,0 +1,277 @@
+//===-- X86GFreeConstSynth.cpp - Evil-free constant synthesis -------------===//
+//
+//                     The LLVM Compiler Infrastructure
+//
+//===----------------------------------------------------------------------===//
+//
+// This file contains a small search engine that, given a constant whose
+// encoding would contain a ret, finds the cheapest two instruction sequence
+// (a mov followed by one transformation) made only of safe immediates. It
+// replaces the single mov + or trick of splitInt, which needs a third
+// instruction every time the low part doesn't fit in an imm32.
+//
+//===----------------------------------------------------------------------===//
+
+#include "X86GFreeConstSynth.h"
+#include "X86GFreeUtils.h"
+#include "X86.h"
+#include "X86InstrInfo.h"
+#include "llvm/CodeGen/MachineInstrBuilder.h"
+#include "llvm/Support/MathExtras.h"
+#include "llvm/Support/raw_ostream.h"
+
+using namespace llvm;
+
+static uint64_t maskToSize(uint64_t Value, unsigned int Bytes){
+  return Bytes == 8 ? Value : Value & ((1ULL << (Bytes * 8)) - 1);
+}
+
+static unsigned int log2Bytes(unsigned int Bytes){
+  return Bytes == 1 ? 0 : Bytes == 2 ? 1 : Bytes == 4 ? 2 : 3;
+}
+
+static uint64_t byteSwap(uint64_t Value, unsigned int Bytes){
+  uint64_t Res = 0;
+  for(unsigned int i = 0; i < Bytes; i++)
+    Res |= ((Value >> (i * 8)) & 0xff) << ((Bytes - 1 - i) * 8);
+  return Res;
+}
+
+static uint64_t rotateLeft(uint64_t Value, unsigned int Bits, unsigned int Count){
+  Count %= Bits;
+  if(Count == 0)
+    return Value;
+  uint64_t Mask = Bits == 64 ? ~0ULL : (1ULL << Bits) - 1;
+  return ((Value << Count) | (Value >> (Bits - Count))) & Mask;
+}
+
+// The value computed by the step Kind (with immediate Imm) on A.
+static uint64_t applyStep(GFreeSynthStep::StepKind Kind, uint64_t A, int64_t Imm, unsigned int Bytes){
+  uint64_t Res;
+  switch(Kind){
+  case GFreeSynthStep::MOV:   Res = Imm; break;
+  case GFreeSynthStep::NOT:   Res = ~A; break;
+  case GFreeSynthStep::NEG:   Res = -A; break;
+  case GFreeSynthStep::BSWAP: Res = byteSwap(A, Bytes); break;
+  case GFreeSynthStep::ROL:   Res = rotateLeft(A, Bytes * 8, Imm); break;
+  case GFreeSynthStep::XOR:   Res = A ^ Imm; break;
+  case GFreeSynthStep::SUB:   Res = A - Imm; break;
+  case GFreeSynthStep::OR:    Res = A | Imm; break;
+  case GFreeSynthStep::ADD:
+  case GFreeSynthStep::LEA:   Res = A + Imm; break;
+  }
+  return maskToSize(Res, Bytes);
+}
+
+bool GFreeConstantSynthesizer::isSafe(int64_t Imm, unsigned int Bytes){
+  std::pair<int64_t, int64_t> split = splitInt(Imm, Bytes * 8);
+  return split.first == 0 && split.second == 0;
+}
+
+// Encoded size of the mov of Imm, 0 if it would contain a ret.
+static unsigned int getMOVSize(uint64_t Imm, unsigned int Bytes){
+  if(Bytes == 8){
+    if(isInt<32>((int64_t)Imm))
+      return GFreeConstantSynthesizer::isSafe(Imm, 4) ? 7 : 0;  // mov $imm32, %r64
+    return GFreeConstantSynthesizer::isSafe(Imm, 8) ? 10 : 0;   // movabs
+  }
+  if(!GFreeConstantSynthesizer::isSafe(Imm, Bytes))
+    return 0;
+  return Bytes == 1 ? 2 : Bytes == 2 ? 4 : 5;
+}
+
+// Encoded size of a step after the mov, 0 if its immediate would contain a
+// ret (or doesn't fit).
+static unsigned int getStepSize(GFreeSynthStep::StepKind Kind, int64_t Imm, unsigned int Bytes){
+  unsigned int Prefix = (Bytes == 2 || Bytes == 8) ? 1 : 0; // 0x66 or REX.W
+  unsigned int ImmBytes = Bytes == 8 ? 4 : Bytes;
+  switch(Kind){
+  case GFreeSynthStep::NOT:
+  case GFreeSynthStep::NEG:
+  case GFreeSynthStep::BSWAP:
+    return 2 + Prefix;
+  case GFreeSynthStep::ROL:
+    return 3 + Prefix;
+  case GFreeSynthStep::XOR:
+  case GFreeSynthStep::ADD:
+  case GFreeSynthStep::SUB:
+  case GFreeSynthStep::OR:
+    if(Bytes == 8 && !isInt<32>(Imm))
+      return 0;
+    return GFreeConstantSynthesizer::isSafe(Imm, ImmBytes) ? 2 + ImmBytes + Prefix : 0;
+  case GFreeSynthStep::LEA:
+    if(!isInt<32>(Imm) || !GFreeConstantSynthesizer::isSafe(Imm, 4))
+      return 0;
+    return 3 + (isInt<8>(Imm) ? 1 : 4);
+  default:
+    return 0;
+  }
+}
+
+// mov First; Kind Imm. Keep it if it builds Value and is cheaper than Best.
+void GFreeConstantSynthesizer::tryStep(uint64_t Value, unsigned int Bytes, bool Is64Bit, GFreeSynthStep::StepKind Kind,
+				       uint64_t First, int64_t Imm, GFreeSynthSeq &Best){
+  First = maskToSize(First, Bytes);
+  if(Kind == GFreeSynthStep::LEA && !(Bytes == 8 || (Bytes == 4 && Is64Bit)))
+    return;
+  if(Kind == GFreeSynthStep::BSWAP && Bytes < 4)
+    return;
+  if(applyStep(Kind, First, Imm, Bytes) != Value)
+    return;
+
+  unsigned int MovSize = getMOVSize(First, Bytes);
+  unsigned int StepSize = getStepSize(Kind, Imm, Bytes);
+  if(MovSize == 0 || StepSize == 0)
+    return;
+  // Latency first, then size.
+  unsigned int Cost = 2 * 16 + MovSize + StepSize;
+  if(Cost >= Best.Cost)
+    return;
+
+  Best.Steps.clear();
+  Best.Steps.push_back({GFreeSynthStep::MOV, (int64_t)First});
+  Best.Steps.push_back({Kind, Imm});
+  Best.Cost = Cost;
+  Best.ClobbersEFLAGS = Kind != GFreeSynthStep::NOT && Kind != GFreeSynthStep::BSWAP &&
+    Kind != GFreeSynthStep::LEA;
+}
+
+void GFreeConstantSynthesizer::search(uint64_t Value, unsigned int Bytes, bool FlagFree, bool Is64Bit,
+				      GFreeSynthSeq &Best){
+  unsigned int Bits = Bytes * 8;
+
+  // A single mov, nothing to synthesize.
+  if(unsigned int MovSize = getMOVSize(Value, Bytes)){
+    Best.Steps.push_back({GFreeSynthStep::MOV, (int64_t)Value});
+    Best.Cost = 16 + MovSize;
+    return;
+  }
+
+  // mov + an unary transformation.
+  tryStep(Value, Bytes, Is64Bit, GFreeSynthStep::NOT, ~Value, 0, Best);
+  if(Bytes >= 4)
+    tryStep(Value, Bytes, Is64Bit, GFreeSynthStep::BSWAP, byteSwap(Value, Bytes), 0, Best);
+  if(!FlagFree){
+    tryStep(Value, Bytes, Is64Bit, GFreeSynthStep::NEG, -Value, 0, Best);
+    for(unsigned int Count = 1; Count < Bits; Count++)
+      tryStep(Value, Bytes, Is64Bit, GFreeSynthStep::ROL, rotateLeft(Value, Bits, Bits - Count), Count, Best);
+  }
+
+  // mov + an immediate that touches only the evil bytes. The low nibbles
+  // of the evil bytes (the splitInt trick) first, then a few other keys.
+  uint64_t Positions = 0;
+  for(unsigned int Shift = 0; Shift < Bits; Shift += 8){
+    uint64_t Byte = (Value >> Shift) & 0xff;
+    uint64_t Next = Shift + 8 < Bits ? (Value >> (Shift + 8)) & 0xff : 0;
+    if(Byte == 0xc2 || Byte == 0xc3 || Byte == 0xca || Byte == 0xcb ||
+       (Byte == 0xff && FFblacklist(Next)))
+      Positions |= 0xffULL << Shift;
+  }
+  static const uint64_t KeyBytes[] = { 0x0f, 0x10, 0x20, 0x40, 0x80, 0x01, 0x02, 0x04, 0x08, 0x30, 0x11 };
+  for(uint64_t KeyByte : KeyBytes){
+    uint64_t Key = 0;
+    for(unsigned int Shift = 0; Shift < Bits; Shift += 8)
+      Key |= KeyByte << Shift;
+    Key &= Positions;
+    // Keep the key as an immediate: for 64 bit it is sign extended.
+    int64_t Imm = Bytes == 8 ? (int64_t)Key : (int64_t)maskToSize(Key, Bytes);
+    if(Bytes == 8 && !isInt<32>(Imm))
+      continue;
+    if(KeyByte == 0x0f){
+      // Value & 0x0f of the evil bytes is contained in Value.
+      int64_t Low = Value & Key;
+      if(Bytes == 8 && !isInt<32>(Low))
+	continue;
+      tryStep(Value, Bytes, Is64Bit, GFreeSynthStep::LEA, Value & ~(uint64_t)Low, Low, Best);
+      if(!FlagFree)
+	tryStep(Value, Bytes, Is64Bit, GFreeSynthStep::OR, Value & ~(uint64_t)Low, Low, Best);
+      continue;
+    }
+    tryStep(Value, Bytes, Is64Bit, GFreeSynthStep::LEA, Value - Imm, Imm, Best);
+    if(FlagFree)
+      continue;
+    tryStep(Value, Bytes, Is64Bit, GFreeSynthStep::XOR, Value ^ Imm, Imm, Best);
+    tryStep(Value, Bytes, Is64Bit, GFreeSynthStep::ADD, Value - Imm, Imm, Best);
+    tryStep(Value, Bytes, Is64Bit, GFreeSynthStep::SUB, Value + Imm, Imm, Best);
+  }
+}
+
+GFreeSynthSeq GFreeConstantSynthesizer::find(int64_t Value, unsigned int Bytes, bool FlagFree, bool Is64Bit){
+  uint64_t Key = maskToSize(Value, Bytes);
+  unsigned int Flags = Bytes | (FlagFree << 4) | (Is64Bit << 5);
+  auto It = Table.find(std::make_pair(Key, Flags));
+  if(It != Table.end())
+    return It->second;
+
+  GFreeSynthSeq Best;
+  search(Key, Bytes, FlagFree, Is64Bit, Best);
+  Table[std::make_pair(Key, Flags)] = Best;
+  return Best;
+}
+
+unsigned int GFreeConstantSynthesizer::emit(const GFreeSynthSeq &Seq, unsigned int Bytes,
+					    MachineBasicBlock &MBB, MachineBasicBlock::iterator I, DebugLoc DL,
+					    const TargetInstrInfo *TII, MachineRegisterInfo &MRI, int *Count){
+  static const unsigned int NEGOpcodes[] = { X86::NEG8r, X86::NEG16r, X86::NEG32r, X86::NEG64r };
+  static const unsigned int ROLOpcodes[] = { X86::ROL8ri, X86::ROL16ri, X86::ROL32ri, X86::ROL64ri };
+  static const unsigned int XOROpcodes[] = { X86::XOR8ri, X86::XOR16ri, X86::XOR32ri, X86::XOR64ri32 };
+  static const unsigned int ADDOpcodes[] = { X86::ADD8ri, X86::ADD16ri, X86::ADD32ri, X86::ADD64ri32 };
+  static const unsigned int SUBOpcodes[] = { X86::SUB8ri, X86::SUB16ri, X86::SUB32ri, X86::SUB64ri32 };
+  unsigned int Idx = log2Bytes(Bytes);
+  const TargetRegisterClass *RegClass = getRegClassFromSize(Bytes);
+  MachineInstrBuilder MIB;
+  unsigned int Reg = 0;
+  *Count = 0;
+
+  for(const GFreeSynthStep &Step : Seq.Steps){
+    unsigned int NewReg = MRI.createVirtualRegister(RegClass);
+    switch(Step.Kind){
+    case GFreeSynthStep::MOV:
+      MIB = BuildMI(MBB, I, DL, TII->get(Bytes != 8 ? getMOVriOpcode(Bytes) :
+					  isInt<32>(Step.Imm) ? X86::MOV64ri32 : X86::MOV64ri), NewReg)
+	.addImm(Step.Imm);
+      break;
+    case GFreeSynthStep::NOT:
+      MIB = BuildMI(MBB, I, DL, TII->get(getNOTrOpcode(Bytes)), NewReg).addReg(Reg);
+      break;
+    case GFreeSynthStep::NEG:
+      MIB = BuildMI(MBB, I, DL, TII->get(NEGOpcodes[Idx]), NewReg).addReg(Reg);
+      break;
+    case GFreeSynthStep::BSWAP:
+      MIB = BuildMI(MBB, I, DL, TII->get(Bytes == 8 ? X86::BSWAP64r : X86::BSWAP32r), NewReg).addReg(Reg);
+      break;
+    case GFreeSynthStep::ROL:
+      MIB = BuildMI(MBB, I, DL, TII->get(ROLOpcodes[Idx]), NewReg).addReg(Reg).addImm(Step.Imm);
+      break;
+    case GFreeSynthStep::XOR:
+      MIB = BuildMI(MBB, I, DL, TII->get(XOROpcodes[Idx]), NewReg).addReg(Reg).addImm(Step.Imm);
+      break;
+    case GFreeSynthStep::ADD:
+      MIB = BuildMI(MBB, I, DL, TII->get(ADDOpcodes[Idx]), NewReg).addReg(Reg).addImm(Step.Imm);
+      break;
+    case GFreeSynthStep::SUB:
+      MIB = BuildMI(MBB, I, DL, TII->get(SUBOpcodes[Idx]), NewReg).addReg(Reg).addImm(Step.Imm);
+      break;
+    case GFreeSynthStep::OR:
+      MIB = BuildMI(MBB, I, DL, TII->get(getORriOpcode(Bytes)), NewReg).addReg(Reg).addImm(Step.Imm);
+      break;
+    case GFreeSynthStep::LEA:
+      if(Bytes == 4){
+	// lea wants a 64 bit base, the upper half is thrown away anyway.
+	unsigned int BaseReg = MRI.createVirtualRegister(&X86::GR64RegClass);
+	MIB = BuildMI(MBB, I, DL, TII->get(TargetOpcode::SUBREG_TO_REG), BaseReg)
+	  .addImm(0).addReg(Reg).addImm(X86::sub_32bit);
+	GFreeDEBUG(0, "> " << *MIB);
+	(*Count)++;
+	Reg = BaseReg;
+      }
+      MIB = BuildMI(MBB, I, DL, TII->get(Bytes == 8 ? X86::LEA64r : X86::LEA64_32r), NewReg)
+	.addReg(Reg).addImm(1).addReg(0).addImm(Step.Imm).addReg(0);
+      break;
+    }
+    GFreeDEBUG(0, "> " << *MIB);
+    (*Count)++;
+    Reg = NewReg;
+  }
+  return Reg;
+}
@@ -0,0 +1,59 @@
+#ifndef GFREECONSTSYNTH_H_
+#define GFREECONSTSYNTH_H_
+
+#include "llvm/CodeGen/MachineBasicBlock.h"
+#include "llvm/CodeGen/MachineRegisterInfo.h"
+#include "llvm/Target/TargetInstrInfo.h"
+#include "llvm/ADT/DenseMap.h"
+#include "llvm/ADT/SmallVector.h"
+
+namespace llvm {
+
+  // One instruction of a synthesized constant. The first one is always a
+  // MOV of Imm, every other one transforms the value of the previous one.
+  struct GFreeSynthStep {
+    enum StepKind { MOV, NOT, NEG, BSWAP, ROL, XOR, ADD, SUB, OR, LEA };
+    StepKind Kind;
+    int64_t Imm;
+  };
+
+  // A sequence of instructions that builds a constant without encoding a
+  // ret. Empty if there is none (within the search depth).
+  struct GFreeSynthSeq {
+    SmallVector<GFreeSynthStep, 2> Steps;
+    unsigned int Cost;
+    bool ClobbersEFLAGS;
+    GFreeSynthSeq() : Cost(~0U), ClobbersEFLAGS(false) {}
+    bool empty() const { return Steps.empty(); }
+  };
+
+  // Searches the cheapest mov + (not|neg|bswap|rol|xor|add|sub|or|lea)
+  // sequence over safe immediates that builds a 8/16/32/64 bit value.
+  // Cost: latency first (one per instruction), then encoded size. The
+  // answers are memoized, so asking again for a constant is a lookup.
+  class GFreeConstantSynthesizer {
+  public:
+    // FlagFree: only not/bswap/lea after the mov. Is64Bit: lea is
+    // available for 32 bit values too.
+    GFreeSynthSeq find(int64_t Value, unsigned int Bytes, bool FlagFree, bool Is64Bit);
+
+    // Emit Seq before I, in SSA form. Returns the register that holds the
+    // constant, *Count is the number of instructions emitted.
+    static unsigned int emit(const GFreeSynthSeq &Seq, unsigned int Bytes,
+			     MachineBasicBlock &MBB, MachineBasicBlock::iterator I, DebugLoc DL,
+			     const TargetInstrInfo *TII, MachineRegisterInfo &MRI, int *Count);
+
+    // True if Imm, as an immediate of Bytes bytes, doesn't contain a ret.
+    static bool isSafe(int64_t Imm, unsigned int Bytes);
+
+  private:
+    // (value, bytes | flagfree << 4 | is64bit << 5)
+    DenseMap<std::pair<uint64_t, unsigned int>, GFreeSynthSeq> Table;
+
+    void search(uint64_t Value, unsigned int Bytes, bool FlagFree, bool Is64Bit, GFreeSynthSeq &Best);
+    void tryStep(uint64_t Value, unsigned int Bytes, bool Is64Bit, GFreeSynthStep::StepKind Kind,
+		 uint64_t First, int64_t Imm, GFreeSynthSeq &Best);
+  };
+
+}
+#endif
@@ -0,0 +1,194 @@
+//===-- X86GFreeImmediateLegalize.cpp - Evil-free constants before ISel ---===//
+//
+//                     The LLVM Compiler Infrastructure
+//
+//===----------------------------------------------------------------------===//
+//
+// This file implements an IR pass, hooked right before the instruction
+// selection (addPreISel), that rewrites the constants and the constant
+// address offsets that would encode a ret (c2/c3/ca/cb/ff-xx) into two safe
+// parts. Each part is hidden behind a no-op bitcast, which SelectionDAG
+// lowers to an opaque constant (the same trick used by ConstantHoisting):
+// the DAG combiner can't fold the parts back together, so they are selected
+// as a plain mov + xor that MachineCSE, MachineLICM and the schedulers
+// handle like any other instruction. GFreeImmediateRecon is left as a safety net for
+// what we can't see here (phis, switches, intrinsics, frame offsets...).
+//
+//===----------------------------------------------------------------------===//
+
+#include "X86.h"
+#include "X86GFreeUtils.h"
+#include "llvm/ADT/DenseMap.h"
+#include "llvm/ADT/Statistic.h"
+#include "llvm/IR/Constants.h"
+#include "llvm/IR/DataLayout.h"
+#include "llvm/IR/Function.h"
+#include "llvm/IR/IRBuilder.h"
+#include "llvm/IR/Instructions.h"
+#include "llvm/IR/IntrinsicInst.h"
+#include "llvm/Pass.h"
+
+using namespace llvm;
+
+#define DEBUG_TYPE "gfreeimmediatelegalize"
+STATISTIC(LegalizedImm    , "Number of evil constants split before the instruction selection");
+STATISTIC(LegalizedOffsets, "Number of evil address offsets split before the instruction selection");
+
+static cl::opt<bool> GFreeNoISelLegalize("gfree-no-isel-legalize", cl::Hidden,
+	       cl::desc("Leave all the evil immediates to the late reconstruction pass"));
+
+namespace {
+  class GFreeImmediateLegalizePass : public FunctionPass {
+  public:
+    GFreeImmediateLegalizePass() : FunctionPass(ID) {}
+    bool runOnFunction(Function &F) override;
+    const char *getPassName() const override {return "Immediate Legalization Pass";}
+    static char ID;
+  private:
+    Value *getSafeConstant(ConstantInt *C, Instruction *InsertPt);
+    bool legalizeOperands(Instruction *I);
+    bool legalizeGEP(GetElementPtrInst *GEP, const DataLayout &DL);
+    // The safe version of each constant, in the block where it was built.
+    DenseMap<std::pair<BasicBlock*, ConstantInt*>, Value*> SafeConstants;
+  };
+  char GFreeImmediateLegalizePass::ID = 0;
+}
+
+FunctionPass *llvm::createGFreeImmediateLegalizePass() {
+  return new GFreeImmediateLegalizePass();
+}
+
+// The evil parts of an immediate of the given width, (0, 0) if it's safe or
+// if it is not a register sized integer.
+static std::pair<int64_t, int64_t> splitConstant(const APInt &Value){
+  unsigned int Bits = Value.getBitWidth();
+  if(Bits != 8 && Bits != 16 && Bits != 32 && Bits != 64)
+    return std::make_pair(0, 0);
+  return splitInt(Value.getSExtValue(), Bits);
+}
+
+// An opaque copy of C: SelectionDAGBuilder turns a bitcast of a ConstantInt
+// into an opaque constant, which is materialized as it is.
+static Value *createOpaqueConstant(IntegerType *Ty, int64_t Imm, Instruction *InsertPt){
+  return new BitCastInst(ConstantInt::get(Ty, Imm, true), Ty, "gfree.imm", InsertPt);
+}
+
+// xor (opaque low), (opaque high), built once per block before its first
+// user. The parts are disjoint, so xor is an or, but the X86 address mode
+// matcher looks through an or (and an add) of constants and would fold them
+// back in a displacement.
+Value *GFreeImmediateLegalizePass::getSafeConstant(ConstantInt *C, Instruction *InsertPt){
+  Value *&Safe = SafeConstants[std::make_pair(InsertPt->getParent(), C)];
+  if(Safe)
+    return Safe;
+
+  std::pair<int64_t, int64_t> split = splitConstant(C->getValue());
+  IntegerType *Ty = C->getType();
+  Value *Low = createOpaqueConstant(Ty, split.first, InsertPt);
+  Value *High = createOpaqueConstant(Ty, split.second, InsertPt);
+  Safe = BinaryOperator::CreateXor(Low, High, "gfree.imm", InsertPt);
+  GFreeDEBUG(1, "[LEGALIZE] " << *C << " -> " << *Safe << "\n");
+  ++LegalizedImm;
+  return Safe;
+}
+
+// Can the constant operands of I be replaced by a register? Not for the
+// instructions that need an immediate (shifts, allocas, intrinsics...),
+// nor for the divisions, which the DAG turns into a multiplication only if
+// the divisor is a constant.
+static bool canTakeRegisterOperands(const Instruction *I){
+  if(const BinaryOperator *BO = dyn_cast<BinaryOperator>(I)){
+    switch(BO->getOpcode()){
+    case Instruction::Add: case Instruction::Sub: case Instruction::Mul:
+    case Instruction::And: case Instruction::Or:  case Instruction::Xor:
+      return true;
+    default:
+      return false;
+    }
+  }
+  if(isa<ICmpInst>(I) || isa<SelectInst>(I) || isa<StoreInst>(I) || isa<ReturnInst>(I))
+    return true;
+  if(const CallInst *CI = dyn_cast<CallInst>(I))
+    return !isa<IntrinsicInst>(CI) && !CI->isInlineAsm();
+  return false;
+}
+
+bool GFreeImmediateLegalizePass::legalizeOperands(Instruction *I){
+  if(!canTakeRegisterOperands(I))
+    return false;
+
+  bool Changed = false;
+  unsigned int NumOperands = I->getNumOperands();
+  // The callee of a call is its last operand.
+  if(isa<CallInst>(I))
+    NumOperands = cast<CallInst>(I)->getNumArgOperands();
+  for(unsigned int i = 0; i < NumOperands; i++){
+    ConstantInt *C = dyn_cast<ConstantInt>(I->getOperand(i));
+    if(!C)
+      continue;
+    std::pair<int64_t, int64_t> split = splitConstant(C->getValue());
+    if(split.first == 0 && split.second == 0)
+      continue;
+    I->setOperand(i, getSafeConstant(C, I));
+    Changed = true;
+  }
+  return Changed;
+}
+
+// gep p, <constant indices> with an evil total offset becomes
+//   gep i8, p, <safe offset>
+// i.e. the offset goes in the index register, the displacement is 0.
+bool GFreeImmediateLegalizePass::legalizeGEP(GetElementPtrInst *GEP, const DataLayout &DL){
+  if(GEP->getType()->isVectorTy() || !GEP->hasAllConstantIndices())
+    return false;
+
+  IntegerType *IntPtrTy = cast<IntegerType>(DL.getIntPtrType(GEP->getType()));
+  APInt Offset(IntPtrTy->getBitWidth(), 0);
+  if(!GEP->accumulateConstantOffset(DL, Offset))
+    return false;
+  std::pair<int64_t, int64_t> split = splitConstant(Offset);
+  if(split.first == 0 && split.second == 0)
+    return false;
+
+  IRBuilder<> Builder(GEP);
+  unsigned int AS = GEP->getPointerAddressSpace();
+  Value *Ptr = Builder.CreateBitCast(GEP->getPointerOperand(), Builder.getInt8PtrTy(AS));
+  Value *Idx = getSafeConstant(ConstantInt::get(IntPtrTy, Offset), GEP);
+  // Same address, so the original inbounds still holds.
+  if(GEP->isInBounds())
+    Ptr = Builder.CreateInBoundsGEP(Builder.getInt8Ty(), Ptr, Idx);
+  else
+    Ptr = Builder.CreateGEP(Builder.getInt8Ty(), Ptr, Idx);
+  Ptr = Builder.CreateBitCast(Ptr, GEP->getType());
+  GFreeDEBUG(1, "[LEGALIZE] " << *GEP << " -> " << *Ptr << "\n");
+
+  Ptr->takeName(GEP);
+  GEP->replaceAllUsesWith(Ptr);
+  GEP->eraseFromParent();
+  ++LegalizedOffsets;
+  return true;
+}
+
+// Main.
+bool GFreeImmediateLegalizePass::runOnFunction(Function &F) {
+  if(DisableGFree || GFreeNoISelLegalize || skipOptnoneFunction(F))
+    return false;
+
+  const DataLayout &DL = F.getParent()->getDataLayout();
+  SafeConstants.clear();
+  bool Changed = false;
+
+  for(BasicBlock &BB : F){
+    for(BasicBlock::iterator II = BB.begin(), IE = BB.end(); II != IE; ){
+      Instruction *I = &*II++;
+      // The bitcasts we insert have a constant operand too.
+      if(isa<BitCastInst>(I) || isa<PHINode>(I))
+	continue;
+      if(GetElementPtrInst *GEP = dyn_cast<GetElementPtrInst>(I))
+	Changed |= legalizeGEP(GEP, DL);
+      else
+	Changed |= legalizeOperands(I);
+    }
+  }
+  return Changed;
+}
@@ -5,17 +5,46 @@
 #include "llvm/Support/raw_ostream.h"
 #include "llvm/Support/TargetRegistry.h"
 #include "X86GFreeUtils.h"
+#include "X86GFreeConstSynth.h"
+#include "X86GFreeVectorImm.h"
 #include "X86.h"
 #include "llvm/CodeGen/MachineFunction.h"
 #include "llvm/CodeGen/MachineFunction.h"
 #include "llvm/CodeGen/MachineFunctionPass.h"
 #include "llvm/ADT/Statistic.h"
+#include "llvm/ADT/DenseSet.h"
+#include "llvm/ADT/DepthFirstIterator.h"
+#include "llvm/CodeGen/MachineDominators.h"
+#include "llvm/CodeGen/MachineLoopInfo.h"
+#include "llvm/CodeGen/RegisterClassInfo.h"
 
 using namespace llvm;
 
 //  Then, on the command line, you can specify '-debug-only=foo'
 #define DEBUG_TYPE "gfreeimmediaterecon"
 STATISTIC(EvilImm , "Number of immediate that contains c2/c3/ca/cb/ff");
+STATISTIC(FlagFreeImm , "Number of evil immediates rebuilt without touching EFLAGS (mov+not/bswap/lea)");
+STATISTIC(SynthImm    , "Number of evil immediates rebuilt by the constant synthesizer");
+STATISTIC(HoistedImm  , "Number of evil immediates rebuilt above the definition of the live EFLAGS");
+STATISTIC(LAHFSaves   , "Number of EFLAGS saved with lahf/sahf");
+STATISTIC(PushfSaves  , "Number of EFLAGS saved with pushfq/popfq");
+STATISTIC(FoldedOffsets, "Number of evil offsets split in two displacements (lea + newMI)");
+STATISTIC(InPlaceImm  , "Number of evil immediates split in place (op a; op b)");
+STATISTIC(AvoidedVirtRegs, "Number of temporary registers avoided by the in place splitting");
+STATISTIC(ReusedImm   , "Number of evil immediates taken from a dominating reconstruction");
+STATISTIC(LoopHoistedImm, "Number of evil immediates reconstructed in a loop preheader");
+
+static cl::opt<bool> GFreeFlagsPushfOnly("gfree-flags-pushf-only", cl::Hidden,
+	       cl::desc("Always preserve the live EFLAGS with pushfq/popfq"));
+
+static cl::opt<bool> GFreeNoImmCSE("gfree-no-imm-cse", cl::Hidden,
+	       cl::desc("Reconstruct every evil immediate where it is used"));
+
+static cl::opt<unsigned> GFreeImmHoistReserve("gfree-imm-hoist-reserve", cl::Hidden, cl::init(5),
+	       cl::desc("GPRs left free in a loop when a reconstructed immediate is made live through it"));
+
+static cl::opt<bool> GFreeNoInPlaceSplit("gfree-no-inplace-split", cl::Hidden,
+	       cl::desc("Always load the evil immediates in a temporary register"));
 
 namespace {
   class GFreeImmediateReconPass : public MachineFunctionPass {
@@ -26,26 +55,77 @@ namespace {
       MF = &mf;
       STI = &MF->getSubtarget<X86Subtarget>();
       TII = MF->getSubtarget().getInstrInfo();
+      MDT = &getAnalysis<MachineDominatorTree>();
+      MLI = &getAnalysis<MachineLoopInfo>();
+      RegClassInfo.runOnMachineFunction(*MF);
+      ConstantRegs.clear();
+      LoopPressure.clear();
+      ChargedLoops.clear();
+      EFLAGSLiveness.compute(*MF);
+      VectorImm.reset(*MF);
+      // Dominators first, so that their constants can be reused below.
+      SmallPtrSet<MachineBasicBlock*, 32> Visited;
+      for (MachineDomTreeNode *Node : depth_first(MDT->getRootNode())){
+	MBB = Node->getBlock();
+	Visited.insert(MBB);
+	runOnMachineBasicBlock();
+      }
       MachineFunction::iterator MBBI, MBBE;
       for (MBBI = MF->begin(), MBBE = MF->end(); MBBI != MBBE; ++MBBI){
 	MBB = &*MBBI;
-	runOnMachineBasicBlock();
+	if(!Visited.count(MBB)) // Unreachable.
+	  runOnMachineBasicBlock();
       }
       return true;
     }
+    void getAnalysisUsage(AnalysisUsage &AU) const override {
+      AU.setPreservesCFG();
+      AU.addRequired<MachineDominatorTree>();
+      AU.addPreserved<MachineDominatorTree>();
+      AU.addRequired<MachineLoopInfo>();
+      AU.addPreserved<MachineLoopInfo>();
+      MachineFunctionPass::getAnalysisUsage(AU);
+    }
     const char *getPassName() const override {return "Immediate Reconstruction Pass";}
     static char ID;
   private:
     unsigned int loadImmediateIntoVirtReg(MachineInstr *MI, std::pair<int64_t, int64_t> split, 
-    					  int ImmediateIndex, int size, int* counter);
-    void emitAddInstSubRegToReg(MachineInstr *MI, unsigned int NewOpcode, unsigned int ImmReg, 
-    				unsigned int BaseRegIndex, unsigned int OffsetIndex);
+    					  int ImmediateIndex, int size, int* counter,
+					  MachineBasicBlock *InsertMBB=nullptr,
+					  MachineBasicBlock::iterator InsertBefore=MachineBasicBlock::iterator());
+    unsigned int getLoopPressure(MachineLoop *L);
+    unsigned int getGPRBudget();
+    bool canExtendLiveRange(unsigned int ImmReg, MachineBasicBlock *DefMBB, MachineInstr *MI);
+    unsigned int reuseImmediate(MachineInstr *MI, int64_t Imm, int size);
+    unsigned int hoistImmediate(MachineInstr *MI, std::pair<int64_t, int64_t> split, int ImmediateIndex, int size);
+    unsigned int loadImmediateFlagFree(MachineInstr *MI, int64_t Imm, int size, int* counter);
+    void saveEFLAGS(MachineBasicBlock::iterator First, MachineBasicBlock::iterator End);
+    bool saveEFLAGSWithLAHF(MachineBasicBlock::iterator First, MachineBasicBlock::iterator End);
+    bool flagsReadOF(MachineBasicBlock::iterator I);
+    bool flagsReadOnlyResult(MachineBasicBlock::iterator I);
+    bool splitImmediateInPlace(MachineInstr *MI, unsigned int ImmediateIndex, int size);
+    bool canFoldOffset(std::pair<int64_t, int64_t> split);
+    void emitLEAOffset(MachineInstr *MI, unsigned int ImmReg, unsigned int BaseRegIndex,
+		       int64_t BaseDisp, int64_t NewDisp);
     void emitNewInstructionMItoMR(MachineInstr *MI, unsigned int NewOpcode, unsigned int ImmReg);
     void emitNewInstructionRItoRR(MachineInstr *MI, unsigned int NewOpcode, unsigned int ImmReg);
     MachineFunction *MF;
     MachineBasicBlock *MBB;
     const X86Subtarget *STI;
     const TargetInstrInfo *TII;
+    GFreeEFLAGSLiveness EFLAGSLiveness;
+    // Kept across functions, the constants are often the same.
+    GFreeConstantSynthesizer Synth;
+    GFreeVectorImmRewriter VectorImm;
+    MachineDominatorTree *MDT;
+    MachineLoopInfo *MLI;
+    RegisterClassInfo RegClassInfo;
+    // The registers holding an evil constant, for each (immediate, size).
+    DenseMap<std::pair<int64_t, int>, SmallVector<unsigned int, 2>> ConstantRegs;
+    // Estimated number of GPRs live through each loop, with the constants
+    // we made live through it (ChargedLoops).
+    DenseMap<MachineLoop*, unsigned int> LoopPressure;
+    DenseSet<std::pair<unsigned int, MachineLoop*>> ChargedLoops;
   };
   char GFreeImmediateReconPass::ID = 0;
   
@@ -57,8 +137,13 @@ FunctionPass *llvm::createGFreeImmediateReconPass() {
 
 // This tables contains, for each instruction that could potentially host an
 // evil byte in the immediate or in the offset, the new opcode and the size of
-// the operand. 
-std::map<unsigned int,std::pair<unsigned int, int>> RItoRR_opcodeMap {
+// the operand. They are only read once, to build the dense table below.
+struct GFreeOpcodeEntry {
+  unsigned int Opcode;
+  std::pair<unsigned int, int> New;
+};
+
+static const GFreeOpcodeEntry RItoRR_opcodeMap[] = {
   { X86::ADC8ri, {X86::ADC8rr, 8} },
   { X86::ADC16ri8, {X86::ADC16rr, 16}},
   { X86::ADC16ri, {X86::ADC16rr, 16}},
@@ -143,10 +228,27 @@ std::map<unsigned int,std::pair<unsigned int, int>> RItoRR_opcodeMap {
   { X86::TEST8ri, {X86::TEST8rr, 8}},
   { X86::TEST16ri, {X86::TEST16rr, 16}},
   { X86::TEST32ri, {X86::TEST32rr, 32}},
-  { X86::TEST64ri32, {X86::TEST64rr, 64}}
+  { X86::TEST64ri32, {X86::TEST64rr, 64}},
+
+  // dst = src * imm becomes dst = src * reg.
+  { X86::IMUL16rri, {X86::IMUL16rr, 16}},
+  { X86::IMUL16rri8, {X86::IMUL16rr, 16}},
+  { X86::IMUL32rri, {X86::IMUL32rr, 32}},
+  { X86::IMUL32rri8, {X86::IMUL32rr, 32}},
+  { X86::IMUL64rri32, {X86::IMUL64rr, 64}},
+  { X86::IMUL64rri8, {X86::IMUL64rr, 64}},
+
+  // The call arguments pushed by X86CallFrameOptimization.
+  { X86::PUSH32i8, {X86::PUSH32r, 32}},
+  { X86::PUSHi32, {X86::PUSH32r, 32}},
+  { X86::PUSH64i8, {X86::PUSH64r, 64}},
+  { X86::PUSH64i32, {X86::PUSH64r, 64}},
 };
 
-std::map<unsigned int,std::pair<unsigned int, int>> MItoMR_opcodeMap {
+static const GFreeOpcodeEntry MItoMR_opcodeMap[] = {
+  {X86::ADC8mi,{X86::ADC8mr,8}},
+  {X86::ADC16mi8,{X86::ADC16mr,16}},
+  {X86::ADC16mi,{X86::ADC16mr,16}},
   {X86::ADC32mi,{X86::ADC32mr,32}},
   {X86::ADC32mi8,{X86::ADC32mr,32}},
   {X86::ADC64mi32,{X86::ADC64mr,64}},
@@ -214,67 +316,153 @@ std::map<unsigned int,std::pair<unsigned int, int>> MItoMR_opcodeMap {
   {X86::MOV64mi32,{X86::MOV64mr,64}},
 };
 
-// This maps are incomplete, but cover the compilation of some real-world program.
-std::map<unsigned int,std::pair<unsigned int, int>> RMtoRM_opcodeMap {
+// The loads and stores whose memory operand starts at 1 (RM) or 0 (MR).
+// Only these layouts are handled, the ALU RM forms (dst, src, mem) are not.
+static const GFreeOpcodeEntry RMtoRM_opcodeMap[] = {
+  {X86::MOVSX16rm8,{X86::MOVSX16rm8,64}},
   {X86::MOVSX32rm8,{X86::MOVSX32rm8,64}},
+  {X86::MOVSX32rm16,{X86::MOVSX32rm16,64}},
+  {X86::MOVSX64rm8,{X86::MOVSX64rm8,64}},
   {X86::MOVSX64rm16,{X86::MOVSX64rm16,64}},
+  {X86::MOVSX64rm32,{X86::MOVSX64rm32,64}},
+  {X86::MOVZX16rm8,{X86::MOVZX16rm8,64}},
   {X86::MOVZX32rm8,{X86::MOVZX32rm8,64}},
+  {X86::MOVZX32rm16,{X86::MOVZX32rm16,64}},
+  {X86::MOVZX64rm8,{X86::MOVZX64rm8,64}},
+  {X86::MOVZX64rm16,{X86::MOVZX64rm16,64}},
   {X86::MOV8rm,{X86::MOV8rm,64}},
   {X86::MOV16rm,{X86::MOV16rm,64}},
   {X86::MOV32rm,{X86::MOV32rm,64}},
   {X86::MOV64rm,{X86::MOV64rm,64}},
+
+  {X86::MOVSSrm,{X86::MOVSSrm,64}},
+  {X86::MOVSDrm,{X86::MOVSDrm,64}},
+  {X86::MOVAPSrm,{X86::MOVAPSrm,64}},
+  {X86::MOVUPSrm,{X86::MOVUPSrm,64}},
+  {X86::MOVAPDrm,{X86::MOVAPDrm,64}},
+  {X86::MOVUPDrm,{X86::MOVUPDrm,64}},
+  {X86::MOVDQArm,{X86::MOVDQArm,64}},
+  {X86::MOVDQUrm,{X86::MOVDQUrm,64}},
+  {X86::VMOVSSrm,{X86::VMOVSSrm,64}},
+  {X86::VMOVSDrm,{X86::VMOVSDrm,64}},
+  {X86::VMOVAPSrm,{X86::VMOVAPSrm,64}},
+  {X86::VMOVUPSrm,{X86::VMOVUPSrm,64}},
+  {X86::VMOVAPDrm,{X86::VMOVAPDrm,64}},
+  {X86::VMOVUPDrm,{X86::VMOVUPDrm,64}},
+  {X86::VMOVDQArm,{X86::VMOVDQArm,64}},
+  {X86::VMOVDQUrm,{X86::VMOVDQUrm,64}},
+  {X86::VMOVAPSYrm,{X86::VMOVAPSYrm,64}},
+  {X86::VMOVUPSYrm,{X86::VMOVUPSYrm,64}},
+  {X86::VMOVAPDYrm,{X86::VMOVAPDYrm,64}},
+  {X86::VMOVUPDYrm,{X86::VMOVUPDYrm,64}},
+  {X86::VMOVDQAYrm,{X86::VMOVDQAYrm,64}},
+  {X86::VMOVDQUYrm,{X86::VMOVDQUYrm,64}},
 };
 
-std::map<unsigned int,std::pair<unsigned int, int>> MRtoMR_opcodeMap {
+static const GFreeOpcodeEntry MRtoMR_opcodeMap[] = {
   {X86::MOV8mr,{X86::MOV8mr,64}},
   {X86::MOV16mr,{X86::MOV16mr,64}},
   {X86::MOV32mr,{X86::MOV32mr,64}},
   {X86::MOV64mr,{X86::MOV64mr,64}},
+
+  {X86::MOVSSmr,{X86::MOVSSmr,64}},
+  {X86::MOVSDmr,{X86::MOVSDmr,64}},
+  {X86::MOVAPSmr,{X86::MOVAPSmr,64}},
+  {X86::MOVUPSmr,{X86::MOVUPSmr,64}},
+  {X86::MOVAPDmr,{X86::MOVAPDmr,64}},
+  {X86::MOVUPDmr,{X86::MOVUPDmr,64}},
+  {X86::MOVDQAmr,{X86::MOVDQAmr,64}},
+  {X86::MOVDQUmr,{X86::MOVDQUmr,64}},
+  {X86::VMOVSSmr,{X86::VMOVSSmr,64}},
+  {X86::VMOVSDmr,{X86::VMOVSDmr,64}},
+  {X86::VMOVAPSmr,{X86::VMOVAPSmr,64}},
+  {X86::VMOVUPSmr,{X86::VMOVUPSmr,64}},
+  {X86::VMOVAPDmr,{X86::VMOVAPDmr,64}},
+  {X86::VMOVUPDmr,{X86::VMOVUPDmr,64}},
+  {X86::VMOVDQAmr,{X86::VMOVDQAmr,64}},
+  {X86::VMOVDQUmr,{X86::VMOVDQUmr,64}},
+  {X86::VMOVAPSYmr,{X86::VMOVAPSYmr,64}},
+  {X86::VMOVUPSYmr,{X86::VMOVUPSYmr,64}},
+  {X86::VMOVAPDYmr,{X86::VMOVAPDYmr,64}},
+  {X86::VMOVUPDYmr,{X86::VMOVUPDYmr,64}},
+  {X86::VMOVDQAYmr,{X86::VMOVDQAYmr,64}},
+  {X86::VMOVDQUYmr,{X86::VMOVDQUYmr,64}},
 };
 
-std::map<unsigned int,std::pair<unsigned int, int>> LEA_opcodeMap {
+static const GFreeOpcodeEntry LEA_opcodeMap[] = {
   {X86::LEA64_32r,{X86::LEA64_32r,64}},
   {X86::LEA16r,{X86::LEA16r,64}},
   {X86::LEA32r,{X86::LEA32r,64}},
   {X86::LEA64r,{X86::LEA64r,64}},
 };
 
+enum GFreeOpcodeKind { OK_NONE, OK_RI, OK_MI, OK_RM, OK_MR, OK_LEA };
+
+// The maps above as a single array indexed by opcode: a lookup is a load,
+// and an unknown opcode doesn't insert anything.
+struct GFreeOpcodeInfo {
+  unsigned int NewOpcode;
+  int Size;
+  GFreeOpcodeKind Kind;
+};
+
+template <size_t N>
+static void fillOpcodeInfo(std::vector<GFreeOpcodeInfo> &Table, const GFreeOpcodeEntry (&Map)[N],
+			   GFreeOpcodeKind Kind){
+  for(const GFreeOpcodeEntry &E : Map){
+    assert(Table[E.Opcode].Kind == OK_NONE && "Opcode in two GFree maps!");
+    Table[E.Opcode] = {E.New.first, E.New.second, Kind};
+  }
+}
+
+static std::vector<GFreeOpcodeInfo> buildOpcodeInfo(){
+  std::vector<GFreeOpcodeInfo> Table(X86::INSTRUCTION_LIST_END, GFreeOpcodeInfo{0, 0, OK_NONE});
+  fillOpcodeInfo(Table, RItoRR_opcodeMap, OK_RI);
+  fillOpcodeInfo(Table, MItoMR_opcodeMap, OK_MI);
+  fillOpcodeInfo(Table, RMtoRM_opcodeMap, OK_RM);
+  fillOpcodeInfo(Table, MRtoMR_opcodeMap, OK_MR);
+  fillOpcodeInfo(Table, LEA_opcodeMap, OK_LEA);
+  return Table;
+}
+
+static const GFreeOpcodeInfo &getOpcodeInfo(unsigned int Opcode){
+  static const std::vector<GFreeOpcodeInfo> Table = buildOpcodeInfo();
+  assert(Opcode < Table.size() && "Not an X86 opcode!");
+  return Table[Opcode];
+}
+
 bool isRI(unsigned int Opcode){
-  return (RItoRR_opcodeMap[Opcode].first != 0);
+  return getOpcodeInfo(Opcode).Kind == OK_RI;
 }
 
 bool isMI(unsigned int Opcode){
-  return (MItoMR_opcodeMap[Opcode].first != 0);
+  return getOpcodeInfo(Opcode).Kind == OK_MI;
 }
 
 bool isMR(unsigned int Opcode){
-  return (MRtoMR_opcodeMap[Opcode].first != 0);
+  return getOpcodeInfo(Opcode).Kind == OK_MR;
 }
 
 bool isRM(unsigned int Opcode){
-  return (RMtoRM_opcodeMap[Opcode].first != 0);
+  return getOpcodeInfo(Opcode).Kind == OK_RM;
 }
 
 bool isLEA(unsigned int Opcode){
-  return (LEA_opcodeMap[Opcode].first != 0);
+  return getOpcodeInfo(Opcode).Kind == OK_LEA;
 }
 
 unsigned int getOpcodeFromMaps(unsigned int Opcode){
-  return (RItoRR_opcodeMap[Opcode].first | 
-	  MItoMR_opcodeMap[Opcode].first |
-	  RMtoRM_opcodeMap[Opcode].first |
-	  MRtoMR_opcodeMap[Opcode].first |
-	  LEA_opcodeMap[Opcode].first 
-	  );
+  return getOpcodeInfo(Opcode).NewOpcode;
 }
 
 unsigned int getSizeFromMaps(unsigned int Opcode){
-  return (RItoRR_opcodeMap[Opcode].second | 
-	  MItoMR_opcodeMap[Opcode].second |
-	  RMtoRM_opcodeMap[Opcode].second |
-	  MRtoMR_opcodeMap[Opcode].second |
-	  LEA_opcodeMap[Opcode].second 
-	  );
+  return getOpcodeInfo(Opcode).Size;
+}
+
+// push imm has no register operand.
+static bool isPushImm(unsigned int Opcode){
+  return Opcode == X86::PUSH32i8 || Opcode == X86::PUSHi32 ||
+    Opcode == X86::PUSH64i8 || Opcode == X86::PUSH64i32;
 }
 
 // Given a RI instruction and a register (ImmReg) that contains the immediate,
@@ -283,6 +471,13 @@ void GFreeImmediateReconPass::emitNewInstructionRItoRR(MachineInstr *MI, unsigne
   MachineBasicBlock::iterator MBBI = MI;
   MachineInstrBuilder MIB;
 
+  if(isPushImm(MI->getOpcode())){ // Handle PUSH.
+    MIB = BuildMI(*MBB, MBBI, MI->getDebugLoc(), TII->get(NewOpcode))
+      .addReg(ImmReg);
+    GFreeDEBUG(0, "> " << *MIB);
+    return;
+  }
+
   bool isMoveCompareTest = isMove(MI) || isCompare(MI) || isTest(MI);
   unsigned int DestReg = MI->getOperand(0).getReg();
   unsigned int SrcRegIndex = isMoveCompareTest ? 0 : 1;
@@ -318,68 +513,41 @@ void GFreeImmediateReconPass::emitNewInstructionMItoMR(MachineInstr *MI, unsigne
   GFreeDEBUG(0, "> " << *MIB); 	    
 }
 
-// This function deals with evil offsets. 
-// ImmReg is a register that contains the offset. 
-// It does emit 3 new instructions:
-// ADD ImmReg, BaseReg
-// INST (w/ offset = 0)
-// SUB ImmReg, BaseReg
-void GFreeImmediateReconPass::emitAddInstSubRegToReg(MachineInstr *MI, unsigned int NewOpcode, unsigned int ImmReg, 
-						     unsigned int BaseRegIndex, unsigned int OffsetIndex){
-  
-  MachineBasicBlock::iterator MBBI = MI;
-  MachineInstrBuilder MIB;
-
-  // The size is always 8 bytes, since we are dealing with memory.
-  unsigned int size = 8;
-  const TargetRegisterClass *RegClass = getRegClassFromSize(size);
-  unsigned int SumReg = MF->getRegInfo().createVirtualRegister(RegClass);
-  unsigned int SubReg = MF->getRegInfo().createVirtualRegister(RegClass);
-  unsigned int SrcReg = MI->getOperand(BaseRegIndex).getReg();
-
-  // ADD
-  MIB = BuildMI(*MBB, MBBI, MI->getDebugLoc(), TII->get(getADDrrOpcode(size)))
-    .addReg(SumReg, RegState::Define)
-    .addReg(SrcReg)
-    .addReg(ImmReg);	
-  GFreeDEBUG(0, "> " << *MIB); 
-
-  MachineInstr *newMI = MF->CloneMachineInstr(MI);
-  MBB->insert(MBBI, newMI);
-  
-  // Adjust operands of the new instruction
-  newMI->getOperand(BaseRegIndex).setReg(SumReg);
-  newMI->getOperand(BaseRegIndex).setIsKill(false); // Clear kill flag because it's used by SUB
-  newMI->getOperand(OffsetIndex).setImm(0);
-  GFreeDEBUG(0, "> " << *newMI);    
-
-  // SUB
-  MIB = BuildMI(*MBB, MBBI, MI->getDebugLoc(), TII->get(getSUBrrOpcode(size)))
-    .addReg(SubReg, RegState::Define)
-    .addReg(SumReg)
-    .addReg(ImmReg);	
-  GFreeDEBUG(0, "> " << *MIB);
-}
-
 // This function safely load an evil immediate into a new register.
 // It returns the number of the new register.
+// The new instructions are inserted before InsertBefore in InsertMBB, if
+// any, otherwise before MI.
 unsigned int GFreeImmediateReconPass::loadImmediateIntoVirtReg(MachineInstr *MI, std::pair<int64_t, int64_t> split,
-							       int ImmediateIndex, int size, int* counter){
+							       int ImmediateIndex, int size, int* counter,
+							       MachineBasicBlock *InsertMBB,
+							       MachineBasicBlock::iterator InsertBefore){
   MachineInstrBuilder MIB;
-  MachineBasicBlock::iterator MBBI = MI;
+  MachineBasicBlock::iterator MBBI = InsertMBB ? InsertBefore : MachineBasicBlock::iterator(MI);
+  if(!InsertMBB)
+    InsertMBB = MBB;
 
   size = size / 8;
+  // The cheapest two instruction sequence, if there's one. The two parts of
+  // split are disjoint.
+  GFreeSynthSeq Seq = Synth.find(split.first | split.second, size, false, STI->is64Bit());
+  if(!Seq.empty()){
+    ++SynthImm;
+    return GFreeConstantSynthesizer::emit(Seq, size, *InsertMBB, MBBI, MI->getDebugLoc(), TII,
+					  MF->getRegInfo(), counter);
+  }
+
+  // Otherwise mov + mov + or.
   const TargetRegisterClass *RegClass = getRegClassFromSize(size);
   unsigned int NewReg = MF->getRegInfo().createVirtualRegister(RegClass);
   unsigned int ImmReg = MF->getRegInfo().createVirtualRegister(RegClass);
 
-  MIB = BuildMI(*MBB, MBBI, MI->getDebugLoc(), TII->get(getMOVriOpcode(size))) // MOV the big part.
+  MIB = BuildMI(*InsertMBB, MBBI, MI->getDebugLoc(), TII->get(getMOVriOpcode(size))) // MOV the big part.
     .addReg(NewReg, RegState::Define)
     .addImm(split.second);
   GFreeDEBUG(0, "> " << *MIB); 	    
 
   if((uint64_t)split.first <= 0xffffffff){ // if the small part fits in 32bit then we can do mov + or.
-    MIB = BuildMI(*MBB, MBBI, MI->getDebugLoc(), TII->get(getORriOpcode(size))) // OR the small part.
+    MIB = BuildMI(*InsertMBB, MBBI, MI->getDebugLoc(), TII->get(getORriOpcode(size))) // OR the small part.
       .addReg(ImmReg, RegState::Define)
       .addReg(NewReg)
       .addImm(split.first); 	    
@@ -388,12 +556,12 @@ unsigned int GFreeImmediateReconPass::loadImmediateIntoVirtReg(MachineInstr *MI,
   }
   else{ // else do mov + mov + or
     unsigned int NewReg1 = MF->getRegInfo().createVirtualRegister(RegClass);
-    MIB = BuildMI(*MBB, MBBI, MI->getDebugLoc(), TII->get(getMOVriOpcode(size))) // MOV the high part.
+    MIB = BuildMI(*InsertMBB, MBBI, MI->getDebugLoc(), TII->get(getMOVriOpcode(size))) // MOV the high part.
       .addReg(NewReg1, RegState::Define)
       .addImm(split.first); 	    
     GFreeDEBUG(0, "> " << *MIB);
     
-    MIB = BuildMI(*MBB, MBBI, MI->getDebugLoc(), TII->get(getORrrOpcode(size))) // OR the two new registers.
+    MIB = BuildMI(*InsertMBB, MBBI, MI->getDebugLoc(), TII->get(getORrrOpcode(size))) // OR the two new registers.
       .addReg(ImmReg, RegState::Define)
       .addReg(NewReg)
       .addReg(NewReg1);
@@ -403,6 +571,436 @@ unsigned int GFreeImmediateReconPass::loadImmediateIntoVirtReg(MachineInstr *MI,
   return ImmReg;
 }
 
+// Same as loadImmediateIntoVirtReg, but the immediate is built without
+// touching EFLAGS (mov + not/bswap/lea). Returns 0 if we can't.
+unsigned int GFreeImmediateReconPass::loadImmediateFlagFree(MachineInstr *MI, int64_t Imm, int size, int* counter){
+  GFreeSynthSeq Seq = Synth.find(Imm, size / 8, true, STI->is64Bit());
+  if(Seq.empty())
+    return 0;
+  return GFreeConstantSynthesizer::emit(Seq, size / 8, *MBB, MI, MI->getDebugLoc(), TII,
+					MF->getRegInfo(), counter);
+}
+
+// ADC/SBB (and friends) read only CF.
+static bool readsOnlyCF(unsigned int Opcode){
+  switch(Opcode){
+  case X86::ADC8rr:  case X86::ADC16rr: case X86::ADC32rr: case X86::ADC64rr:
+  case X86::SBB8rr:  case X86::SBB16rr: case X86::SBB32rr: case X86::SBB64rr:
+  case X86::ADC8rm:  case X86::ADC16rm: case X86::ADC32rm: case X86::ADC64rm:
+  case X86::SBB8rm:  case X86::SBB16rm: case X86::SBB32rm: case X86::SBB64rm:
+  case X86::ADC8mr:  case X86::ADC16mr: case X86::ADC32mr: case X86::ADC64mr:
+  case X86::SBB8mr:  case X86::SBB16mr: case X86::SBB32mr: case X86::SBB64mr:
+  case X86::SETB_C8r: case X86::SETB_C16r: case X86::SETB_C32r: case X86::SETB_C64r:
+    return true;
+  }
+  return false;
+}
+
+// The condition tested by a jcc/setcc/cmovcc, COND_INVALID for any other
+// reader of the flags.
+static X86::CondCode getFlagsReaderCond(const MachineInstr &MI){
+  X86::CondCode CC = X86::getCondFromBranchOpc(MI.getOpcode());
+  if(CC == X86::COND_INVALID)
+    CC = X86::getCondFromSETOpc(MI.getOpcode());
+  if(CC == X86::COND_INVALID)
+    CC = X86::getCondFromCMovOpc(MI.getOpcode());
+  return CC;
+}
+
+// Do the readers of the flags, from I on, need OF? sahf doesn't restore it.
+bool GFreeImmediateReconPass::flagsReadOF(MachineBasicBlock::iterator I){
+  for(; I != MBB->end(); ++I){
+    if(I->readsRegister(X86::EFLAGS)){
+      X86::CondCode CC = getFlagsReaderCond(*I);
+      if(CC == X86::COND_INVALID && !readsOnlyCF(I->getOpcode()))
+	return true;
+      if(CC == X86::COND_O || CC == X86::COND_NO || CC == X86::COND_L ||
+	 CC == X86::COND_GE || CC == X86::COND_LE || CC == X86::COND_G)
+	return true;
+    }
+    if(I->definesRegister(X86::EFLAGS))
+      return false;
+  }
+  // We don't look into the successors.
+  return EFLAGSLiveness.isLiveOut(MBB);
+}
+
+// Do the readers of the flags, from I on, look only at ZF, SF and PF? These
+// depend only on the result, which is the same if we split the immediate.
+bool GFreeImmediateReconPass::flagsReadOnlyResult(MachineBasicBlock::iterator I){
+  for(; I != MBB->end(); ++I){
+    if(I->readsRegister(X86::EFLAGS)){
+      X86::CondCode CC = getFlagsReaderCond(*I);
+      if(CC != X86::COND_E && CC != X86::COND_NE && CC != X86::COND_S &&
+	 CC != X86::COND_NS && CC != X86::COND_P && CC != X86::COND_NP)
+	return false;
+    }
+    if(I->definesRegister(X86::EFLAGS))
+      return true;
+  }
+  return !EFLAGSLiveness.isLiveOut(MBB);
+}
+
+// Save the flags with lahf (and seto if OF is needed), restore them with
+// (add $127 for OF and) sahf. Much cheaper than popfq, but it needs AH.
+bool GFreeImmediateReconPass::saveEFLAGSWithLAHF(MachineBasicBlock::iterator First, MachineBasicBlock::iterator End){
+  const TargetRegisterInfo *TRI = STI->getRegisterInfo();
+  if(!STI->hasLAHFSAHF())
+    return false;
+  // AH is a physical register, RAX must be free around the whole sequence.
+  if(MBB->computeRegisterLiveness(TRI, X86::RAX, First, 16) != MachineBasicBlock::LQR_Dead)
+    return false;
+  for(MachineBasicBlock::iterator I = First; I != End; ++I){
+    if(I->readsRegister(X86::RAX, TRI) || I->modifiesRegister(X86::RAX, TRI))
+      return false;
+  }
+
+  bool NeedOF = flagsReadOF(End);
+  DebugLoc DL = First->getDebugLoc();
+  MachineInstrBuilder MIB;
+  unsigned int SavedAH = MF->getRegInfo().createVirtualRegister(&X86::GR8_NOREXRegClass);
+  unsigned int SavedOF = 0;
+
+  if(NeedOF){
+    SavedOF = MF->getRegInfo().createVirtualRegister(&X86::GR8RegClass);
+    MIB = BuildMI(*MBB, First, DL, TII->get(X86::SETOr), SavedOF);
+    GFreeDEBUG(0, "> " << *MIB);
+  }
+  MIB = BuildMI(*MBB, First, DL, TII->get(X86::LAHF));
+  GFreeDEBUG(0, "> " << *MIB);
+  MIB = BuildMI(*MBB, First, DL, TII->get(TargetOpcode::COPY), SavedAH)
+    .addReg(X86::AH, RegState::Kill);
+  GFreeDEBUG(0, "> " << *MIB);
+
+  if(NeedOF){
+    // 1 + 127 overflows, 0 + 127 doesn't. sahf leaves OF alone.
+    unsigned int DeadReg = MF->getRegInfo().createVirtualRegister(&X86::GR8RegClass);
+    MIB = BuildMI(*MBB, End, DL, TII->get(X86::ADD8ri), DeadReg)
+      .addReg(SavedOF)
+      .addImm(127);
+    GFreeDEBUG(0, "> " << *MIB);
+  }
+  MIB = BuildMI(*MBB, End, DL, TII->get(TargetOpcode::COPY), X86::AH)
+    .addReg(SavedAH);
+  GFreeDEBUG(0, "> " << *MIB);
+  MIB = BuildMI(*MBB, End, DL, TII->get(X86::SAHF));
+  // sahf keeps the OF of the add: without the use the add looks dead.
+  if(NeedOF)
+    MIB.addReg(X86::EFLAGS, RegState::Implicit);
+  GFreeDEBUG(0, "> " << *MIB);
+  return true;
+}
+
+// Preserve the flags across [First, End), the cheapest way we can.
+// popfq is microcoded and serializing, so it's the last resort. The flags
+// are live before First: they are defined above it or live into the block.
+void GFreeImmediateReconPass::saveEFLAGS(MachineBasicBlock::iterator First, MachineBasicBlock::iterator End){
+  if(!GFreeFlagsPushfOnly && saveEFLAGSWithLAHF(First, End)){
+    ++LAHFSaves;
+    return;
+  }
+  ++PushfSaves;
+  GFreeDEBUG(0, "> Push/Pop EFLAGS\n");	
+  unsigned int saveRegEFLAGS = MF->getRegInfo().createVirtualRegister(&X86::GR64RegClass);
+  pushEFLAGSinline( First, saveRegEFLAGS );
+  popEFLAGSinline ( End, saveRegEFLAGS );
+}
+
+enum InPlaceKind { IP_NONE, IP_ADD, IP_SUB, IP_OR, IP_XOR, IP_AND, IP_CMP };
+
+// The RI form with a full size immediate of an ALU instruction that can be
+// split in place, and what it does.
+static unsigned int getInPlaceRIOpcode(unsigned int Opcode, InPlaceKind &Kind){
+  Kind = IP_NONE;
+  switch(Opcode){
+  case X86::ADD8ri: Kind = IP_ADD; return X86::ADD8ri;
+  case X86::ADD16ri: case X86::ADD16ri8: case X86::ADD16ri_DB: case X86::ADD16ri8_DB:
+    Kind = IP_ADD; return X86::ADD16ri;
+  case X86::ADD32ri: case X86::ADD32ri8: case X86::ADD32ri_DB: case X86::ADD32ri8_DB:
+    Kind = IP_ADD; return X86::ADD32ri;
+  case X86::ADD64ri32: case X86::ADD64ri8: case X86::ADD64ri32_DB: case X86::ADD64ri8_DB:
+    Kind = IP_ADD; return X86::ADD64ri32;
+
+  case X86::SUB8ri: Kind = IP_SUB; return X86::SUB8ri;
+  case X86::SUB16ri: case X86::SUB16ri8: Kind = IP_SUB; return X86::SUB16ri;
+  case X86::SUB32ri: case X86::SUB32ri8: Kind = IP_SUB; return X86::SUB32ri;
+  case X86::SUB64ri32: case X86::SUB64ri8: Kind = IP_SUB; return X86::SUB64ri32;
+
+  case X86::OR8ri: Kind = IP_OR; return X86::OR8ri;
+  case X86::OR16ri: case X86::OR16ri8: Kind = IP_OR; return X86::OR16ri;
+  case X86::OR32ri: case X86::OR32ri8: Kind = IP_OR; return X86::OR32ri;
+  case X86::OR64ri32: case X86::OR64ri8: Kind = IP_OR; return X86::OR64ri32;
+
+  case X86::XOR8ri: Kind = IP_XOR; return X86::XOR8ri;
+  case X86::XOR16ri: case X86::XOR16ri8: Kind = IP_XOR; return X86::XOR16ri;
+  case X86::XOR32ri: case X86::XOR32ri8: Kind = IP_XOR; return X86::XOR32ri;
+  case X86::XOR64ri32: case X86::XOR64ri8: Kind = IP_XOR; return X86::XOR64ri32;
+
+  case X86::AND8ri: Kind = IP_AND; return X86::AND8ri;
+  case X86::AND16ri: case X86::AND16ri8: Kind = IP_AND; return X86::AND16ri;
+  case X86::AND32ri: case X86::AND32ri8: Kind = IP_AND; return X86::AND32ri;
+  case X86::AND64ri32: case X86::AND64ri8: Kind = IP_AND; return X86::AND64ri32;
+
+  case X86::CMP8ri: Kind = IP_CMP; return X86::CMP8ri;
+  case X86::CMP16ri: case X86::CMP16ri8: Kind = IP_CMP; return X86::CMP16ri;
+  case X86::CMP32ri: case X86::CMP32ri8: Kind = IP_CMP; return X86::CMP32ri;
+  case X86::CMP64ri32: case X86::CMP64ri8: Kind = IP_CMP; return X86::CMP64ri32;
+  }
+  return 0;
+}
+
+static unsigned int getSUBriOpcode(int size){
+  switch(size){
+  case 8:  return X86::SUB8ri;
+  case 16: return X86::SUB16ri;
+  case 32: return X86::SUB32ri;
+  }
+  return X86::SUB64ri32;
+}
+
+// Can Imm be the immediate of a size bit instruction (an imm32 for 64 bit)
+// without encoding a ret?
+static bool isSafeImmediate(int64_t Imm, int size){
+  if(size == 64){
+    if(!isInt<32>(Imm))
+      return false;
+    size = 32;
+  }
+  std::pair<int64_t, int64_t> split = splitInt(Imm, size);
+  return split.first == 0 && split.second == 0;
+}
+
+// Can the two parts of an evil offset both be displacements?
+bool GFreeImmediateReconPass::canFoldOffset(std::pair<int64_t, int64_t> split){
+  return isSafeImmediate(split.first, 64) && isSafeImmediate(split.second, 64);
+}
+
+// Given a memory instruction with an evil offset, compute the base of the
+// new memory operand with a lea, which leaves the flags alone:
+//   lea sum = [base + ImmReg + BaseDisp]; newMI [sum + index*scale + NewDisp]
+// The offset is either held by ImmReg (BaseDisp = NewDisp = 0) or folded in
+// two safe displacements (ImmReg = 0). The index stays in newMI.
+void GFreeImmediateReconPass::emitLEAOffset(MachineInstr *MI, unsigned int ImmReg, unsigned int BaseRegIndex,
+					    int64_t BaseDisp, int64_t NewDisp){
+  MachineBasicBlock::iterator MBBI = MI;
+  MachineInstrBuilder MIB;
+  const MachineOperand &Base = MI->getOperand(BaseRegIndex);
+  unsigned int SumReg = MF->getRegInfo().createVirtualRegister(&X86::GR64RegClass);
+  if(ImmReg) // It is the index of the lea.
+    MF->getRegInfo().constrainRegClass(ImmReg, &X86::GR64_NOSPRegClass);
+
+  // LEA
+  MIB = BuildMI(*MBB, MBBI, MI->getDebugLoc(), TII->get(X86::LEA64r), SumReg)
+    .addReg(Base.getReg(), 0, Base.getSubReg())
+    .addImm(1)
+    .addReg(ImmReg)
+    .addImm(BaseDisp)
+    .addReg(0);
+  GFreeDEBUG(0, "> " << *MIB);
+
+  MachineInstr *newMI = MF->CloneMachineInstr(MI);
+  MBB->insert(MBBI, newMI);
+  
+  // Adjust operands of the new instruction
+  newMI->getOperand(BaseRegIndex).setReg(SumReg);
+  newMI->getOperand(BaseRegIndex).setSubReg(0);
+  newMI->getOperand(BaseRegIndex).setIsKill(true);
+  newMI->getOperand(BaseRegIndex + X86::AddrDisp).setImm(NewDisp);
+  GFreeDEBUG(0, "> " << *newMI);    
+}
+
+// Split the evil immediate of an ALU instruction in two safe immediates and
+// apply them one after the other to the same register:
+//   add x, 0xc3aa  ->  add x, 0x300; add x, 0xc0aa
+//   and x, 0xc3aa  ->  and x, 0xcfaf; and x, 0xf3fa
+//   cmp x, 0xc3aa  ->  t = x - 0x300; cmp t, 0xc0aa
+// The result is the same, so are ZF, SF and PF. CF, OF and AF are not
+// for add, sub and cmp: the flags must be dead or read only through
+// ZF/SF/PF. No temporary register holds the immediate, and the
+// intermediate value of add/sub/or/xor/and is tied to the result.
+// The new instructions are inserted before MI, the caller erases it.
+bool GFreeImmediateReconPass::splitImmediateInPlace(MachineInstr *MI, unsigned int ImmediateIndex, int size){
+  InPlaceKind Kind;
+  unsigned int Opcode = getInPlaceRIOpcode(MI->getOpcode(), Kind);
+  if(Opcode == 0)
+    return false;
+  // dst = op src, imm / cmp src, imm
+  unsigned int SrcIndex = Kind == IP_CMP ? 0 : 1;
+  if(ImmediateIndex != SrcIndex + 1 || !MI->getOperand(SrcIndex).isReg() ||
+     (Kind != IP_CMP && !TargetRegisterInfo::isVirtualRegister(MI->getOperand(0).getReg())))
+    return false;
+
+  // The flags.
+  bool ResultFlagsOnly = Kind == IP_ADD || Kind == IP_SUB || Kind == IP_CMP;
+  if(ResultFlagsOnly && EFLAGSLiveness.isLiveAfter(MI) && !flagsReadOnlyResult(std::next(MachineBasicBlock::iterator(MI))))
+    return false;
+
+  // The two parts.
+  int64_t Imm = MI->getOperand(ImmediateIndex).getImm();
+  uint64_t Mask = size == 64 ? ~0ULL : (1ULL << size) - 1;
+  std::pair<int64_t, int64_t> split = splitInt(Imm, size);
+  int64_t A = split.first, B = split.second;
+  if(Kind == IP_AND){
+    // Each part keeps all the bits of Imm and sets half of the others.
+    A = Imm | (0x0f0f0f0fLL & Mask);
+    B = Imm | (0xf0f0f0f0LL & Mask);
+    if(size == 64){
+      A = (int32_t)A;
+      B = (int32_t)B;
+    }
+  }
+  uint64_t Res;
+  switch(Kind){
+  case IP_AND: Res = (uint64_t)A & (uint64_t)B; break;
+  case IP_OR:  Res = (uint64_t)A | (uint64_t)B; break;
+  case IP_XOR: Res = (uint64_t)A ^ (uint64_t)B; break;
+  default:     Res = (uint64_t)A + (uint64_t)B; break;
+  }
+  if((Res & Mask) != ((uint64_t)Imm & Mask) ||
+     !isSafeImmediate(A, size) || !isSafeImmediate(B, size))
+    return false;
+
+  const TargetRegisterInfo *TRI = STI->getRegisterInfo();
+  MachineRegisterInfo &MRI = MF->getRegInfo();
+  MachineBasicBlock::iterator MBBI = MI;
+  MachineInstrBuilder MIB;
+  const TargetRegisterClass *RegClass = Kind == IP_CMP ? getRegClassFromSize(size / 8) :
+    MRI.getRegClass(MI->getOperand(0).getReg());
+  unsigned int TmpReg = MRI.createVirtualRegister(RegClass);
+
+  // The first half, its flags are dead.
+  MIB = BuildMI(*MBB, MBBI, MI->getDebugLoc(), TII->get(Kind == IP_CMP ? getSUBriOpcode(size) : Opcode), TmpReg)
+    .addOperand(MI->getOperand(SrcIndex))
+    .addImm(A);
+  MIB->addRegisterDead(X86::EFLAGS, TRI);
+  GFreeDEBUG(0, "> " << *MIB);
+
+  // The second half, it defines the flags (and the result) of MI.
+  if(Kind == IP_CMP)
+    MIB = BuildMI(*MBB, MBBI, MI->getDebugLoc(), TII->get(Opcode));
+  else
+    MIB = BuildMI(*MBB, MBBI, MI->getDebugLoc(), TII->get(Opcode), MI->getOperand(0).getReg());
+  MIB.addReg(TmpReg, RegState::Kill)
+    .addImm(B);
+  if(MI->registerDefIsDead(X86::EFLAGS))
+    MIB->addRegisterDead(X86::EFLAGS, TRI);
+  GFreeDEBUG(0, "> " << *MIB);
+
+  ++InPlaceImm;
+  // loadImmediateIntoVirtReg would have used two or three, cmp still needs one.
+  AvoidedVirtRegs += ((uint64_t)split.first <= 0xffffffff ? 2 : 3) - (Kind == IP_CMP ? 1 : 0);
+  return true;
+}
+
+static bool isGPRClass(const TargetRegisterClass *RC){
+  return X86::GR64RegClass.hasSubClassEq(RC) || X86::GR32RegClass.hasSubClassEq(RC) ||
+    X86::GR16RegClass.hasSubClassEq(RC) || X86::GR8RegClass.hasSubClassEq(RC);
+}
+
+// The number of GPRs that are live through L: the virtual registers used in
+// L and defined outside. This is a lower bound of the pressure in L, that's
+// why GFreeImmHoistReserve registers are left free.
+unsigned int GFreeImmediateReconPass::getLoopPressure(MachineLoop *L){
+  auto It = LoopPressure.find(L);
+  if(It != LoopPressure.end())
+    return It->second;
+
+  MachineRegisterInfo &MRI = MF->getRegInfo();
+  DenseSet<unsigned int> LiveThrough;
+  for(MachineBasicBlock *LoopMBB : L->getBlocks()){
+    for(MachineInstr &LoopMI : *LoopMBB){
+      for(const MachineOperand &MO : LoopMI.operands()){
+	if(!MO.isReg() || !MO.isUse() || !TargetRegisterInfo::isVirtualRegister(MO.getReg()))
+	  continue;
+	MachineInstr *Def = MRI.getVRegDef(MO.getReg());
+	if(Def && !L->contains(Def->getParent()) && isGPRClass(MRI.getRegClass(MO.getReg())))
+	  LiveThrough.insert(MO.getReg());
+      }
+    }
+  }
+  return LoopPressure[L] = LiveThrough.size();
+}
+
+// How many GPRs can be live through a loop before it spills.
+unsigned int GFreeImmediateReconPass::getGPRBudget(){
+  unsigned int NumRegs = RegClassInfo.getNumAllocatableRegs(&X86::GR64RegClass);
+  return NumRegs > GFreeImmHoistReserve ? NumRegs - GFreeImmHoistReserve : 0;
+}
+
+// Using ImmReg (defined in DefMBB) at MI makes it live through all the loops
+// that contain MI and not DefMBB. Allow it only if they have a free GPR, and
+// take it.
+bool GFreeImmediateReconPass::canExtendLiveRange(unsigned int ImmReg, MachineBasicBlock *DefMBB, MachineInstr *MI){
+  unsigned int Budget = getGPRBudget();
+  SmallVector<MachineLoop*, 4> Loops;
+  for(MachineLoop *L = MLI->getLoopFor(MI->getParent()); L && !L->contains(DefMBB); L = L->getParentLoop()){
+    if(ChargedLoops.count(std::make_pair(ImmReg, L)))
+      continue;
+    if(getLoopPressure(L) + 1 > Budget)
+      return false;
+    Loops.push_back(L);
+  }
+  for(MachineLoop *L : Loops){
+    LoopPressure[L]++;
+    ChargedLoops.insert(std::make_pair(ImmReg, L));
+  }
+  return true;
+}
+
+// A register that already holds Imm and whose definition dominates MI, 0 if
+// there is none (or if it would raise the pressure of a loop too much).
+unsigned int GFreeImmediateReconPass::reuseImmediate(MachineInstr *MI, int64_t Imm, int size){
+  auto It = ConstantRegs.find(std::make_pair(Imm, size));
+  if(It == ConstantRegs.end())
+    return 0;
+  for(unsigned int ImmReg : It->second){
+    MachineInstr *Def = MF->getRegInfo().getVRegDef(ImmReg);
+    if(Def && MDT->dominates(Def, MI) && canExtendLiveRange(ImmReg, Def->getParent(), MI))
+      return ImmReg;
+  }
+  return 0;
+}
+
+// If MI is in a loop, reconstruct the immediate in the preheader of the
+// outermost loop that has one and a free GPR. The mov/or go at the end of
+// the preheader, where the flags are dead. Returns 0 if we can't.
+unsigned int GFreeImmediateReconPass::hoistImmediate(MachineInstr *MI, std::pair<int64_t, int64_t> split,
+						     int ImmediateIndex, int size){
+  MachineLoop *Target = nullptr;
+  for(MachineLoop *L = MLI->getLoopFor(MBB); L && L->getLoopPreheader(); L = L->getParentLoop())
+    Target = L;
+  if(!Target)
+    return 0;
+
+  MachineBasicBlock *Preheader = Target->getLoopPreheader();
+  MachineBasicBlock::iterator InsertPt = Preheader->getFirstTerminator();
+  while(InsertPt == Preheader->end() ? EFLAGSLiveness.isLiveOut(Preheader) : EFLAGSLiveness.isLiveBefore(InsertPt)){
+    if(InsertPt == Preheader->begin())
+      return 0;
+    --InsertPt;
+    if(InsertPt->isPHI() || InsertPt->isLabel())
+      return 0;
+  }
+  // The constant is live from the preheader to MI, i.e. through Target and
+  // the loops in between. Charge them, and give up if one is full: the
+  // constant would be spilled, which is worse than rebuilding it.
+  unsigned int Budget = getGPRBudget();
+  for(MachineLoop *L = MLI->getLoopFor(MBB); L != Target->getParentLoop(); L = L->getParentLoop()){
+    if(getLoopPressure(L) + 1 > Budget)
+      return 0;
+  }
+
+  int counter = 0;
+  unsigned int ImmReg = loadImmediateIntoVirtReg(MI, split, ImmediateIndex, size, &counter, Preheader, InsertPt);
+  for(MachineLoop *L = MLI->getLoopFor(MBB); L != Target->getParentLoop(); L = L->getParentLoop()){
+    LoopPressure[L]++;
+    ChargedLoops.insert(std::make_pair(ImmReg, L));
+  }
+  for(int j = 0; j < counter; j++)
+    EFLAGSLiveness.addInstr(--InsertPt);
+  return ImmReg;
+}
+
 // Main.
 bool GFreeImmediateReconPass::runOnMachineBasicBlock() {
   
@@ -421,10 +1019,33 @@ bool GFreeImmediateReconPass::runOnMachineBasicBlock() {
   MachineInstr *MI;
   unsigned int i;
   std::pair<int64_t, int64_t> split;
-  bool pushEFLAGS;
+  // The last instruction above MBBI where the flags are dead: an immediate
+  // loaded there doesn't need to save them.
+  MachineInstr *DeadPt = nullptr;
+  // Where to go on. A rewritten instruction can still have another evil
+  // operand (mov [rax+0xc3], 0xc3), so it is visited again.
+  MachineBasicBlock::iterator ResumeMBBI;
   
-  for (MBBI = MBB->begin(), MBBIE = MBB->end(); MBBI != MBBIE; ++MBBI) {
+  for (MBBI = MBB->begin(), MBBIE = MBB->end(); MBBI != MBBIE; MBBI = ResumeMBBI) {
+    ResumeMBBI = std::next(MBBI);
     MI = MBBI;
+    if(!MI->isPHI() && !MI->isLabel() && !EFLAGSLiveness.isLiveBefore(MI))
+      DeadPt = MI;
+
+    // Shuffle and blend masks: no register form, but another mask (or
+    // another shuffle) does the same. EFLAGS is not touched.
+    if(unsigned int Count = VectorImm.rewrite(MI)){
+      ++EvilImm;
+      GFreeDEBUG(0, "< " << *MI);
+      MachineBasicBlock::iterator NextMBBI = std::next(MBBI);
+      if(DeadPt == MI)
+	DeadPt = std::prev(MBBI, Count);
+      MI->eraseFromParent();
+      for(MachineBasicBlock::iterator I = NextMBBI, FirstNew = std::prev(NextMBBI, Count); I != FirstNew; )
+	EFLAGSLiveness.addInstr(--I);
+      MBBI = std::prev(NextMBBI);
+      continue;
+    }
 
     for(i=0; i<MI->getNumOperands(); i++){
       MachineOperand MO = MI->getOperand(i);
@@ -454,12 +1075,22 @@ bool GFreeImmediateReconPass::runOnMachineBasicBlock() {
 	   (isLEA(MI->getOpcode()) && MI->getOperand(1).isFI())||
 	   // ./compile-O3-fileU9CBCR.c
 	   (isLEA(MI->getOpcode()) && MI->getOperand(1).getReg() == 0)||
+	   // A rip relative base would be relative to the lea.
+	   ((isRM(MI->getOpcode()) || isLEA(MI->getOpcode())) &&
+	    MI->getOperand(1).isReg() && MI->getOperand(1).getReg() == X86::RIP) ||
+	   ((isMR(MI->getOpcode()) || (isMI(MI->getOpcode()) && i == 3)) &&
+	    MI->getOperand(0).isReg() && MI->getOperand(0).getReg() == X86::RIP) ||
 	   (NewOpcode == 0)                                    ){ 
       	GFreeDEBUG(0, "[TODO @ " << MF->getName() << "]: " << *MI);
       	continue;
       }
 
-      pushEFLAGS = needToSaveEFLAGS(MBBI); 
+      // Are the flags needed by the new MI (or by the original MI)?
+      bool LiveBefore = EFLAGSLiveness.isLiveBefore(MI);
+      // Remember where the new instructions will be.
+      bool AtBegin = MBBI == MBB->begin();
+      MachineBasicBlock::iterator PrevMBBI = AtBegin ? MBBIE : std::prev(MBBI);
+      MachineBasicBlock::iterator NextMBBI = std::next(MBBI);
 
       ++EvilImm; // Update stats
 
@@ -468,50 +1099,99 @@ bool GFreeImmediateReconPass::runOnMachineBasicBlock() {
       GFreeDEBUG(2, "[IMM]       : " << format("0x%016llx @ %s \n", MO.getImm(), MF->getName() ) <<
                     "[IMM]       : " << format("(low = 0x%016llx, high = 0x%016llx)\n", split.first, split.second));
 
+      // Without a temporary register, if we can.
+      if(!GFreeNoInPlaceSplit && splitImmediateInPlace(MI, i, Size)){
+	GFreeDEBUG(0, "< " << *MI);
+	// The flags are dead before the first op if they were dead before MI.
+	if(DeadPt == MI)
+	  DeadPt = std::prev(MBBI, 2);
+	MI->eraseFromParent();
+	for(MachineBasicBlock::iterator I = NextMBBI, FirstNew = std::prev(NextMBBI, 2); I != FirstNew; )
+	  EFLAGSLiveness.addInstr(--I);
+	// Both halves keep the other operands.
+	ResumeMBBI = std::prev(NextMBBI, 2);
+	break;
+      }
+
       toDelete.push_back(MI);
       GFreeDEBUG(0, "< " << *MI); 	    
 
       int emittedInstCounter = 0; // This counter will be used for the handling EFLAGS
-      unsigned int ImmReg = loadImmediateIntoVirtReg(MI, split, i, Size,&emittedInstCounter);
-      bool flagImmediate=0;
+      unsigned int ImmReg = 0;
+      // 5 is the index of an immediate in a *mi instruction.
+      bool flagImmediate = isRI(MI->getOpcode()) || (isMI(MI->getOpcode()) && i == 5);
+      // The memory operand of an offset (3 is the index of an offset in a *mi instruction).
+      unsigned int BaseRegIndex = (isLEA(MI->getOpcode()) || isRM(MI->getOpcode())) ? 1 : 0;
+      // Offsets are rebuilt with a lea, if both parts are good displacements
+      // we don't even need the register.
+      bool FoldOffset = !flagImmediate && canFoldOffset(split);
+      // Does the mov/or sequence right before newMI clobber the flags?
+      bool FlagsClobbered = !FoldOffset;
+
+      // Is the constant already in a register, or can it be built once out
+      // of the loop?
+      bool Reused = false;
+      if(!FoldOffset && !GFreeNoImmCSE){
+	ImmReg = reuseImmediate(MI, MO.getImm(), Size);
+	if(ImmReg){
+	  ++ReusedImm;
+	  Reused = true;
+	}
+	else{
+	  ImmReg = hoistImmediate(MI, split, i, Size);
+	  if(ImmReg)
+	    ++LoopHoistedImm;
+	}
+	if(ImmReg)
+	  FlagsClobbered = false;
+      }
+
+      // The flags are live here: first try to build the immediate without
+      // touching them, then to build it above their definition.
+      if(LiveBefore && FlagsClobbered && !GFreeFlagsPushfOnly){
+	ImmReg = loadImmediateFlagFree(MI, MO.getImm(), Size, &emittedInstCounter);
+	if(ImmReg){
+	  ++FlagFreeImm;
+	  FlagsClobbered = false;
+	}
+	else if(DeadPt){
+	  ImmReg = loadImmediateIntoVirtReg(MI, split, i, Size, &emittedInstCounter, MBB, DeadPt);
+	  MachineBasicBlock::iterator I = DeadPt;
+	  for(int j = 0; j < emittedInstCounter; j++)
+	    EFLAGSLiveness.addInstr(--I);
+	  ++HoistedImm;
+	  FlagsClobbered = false;
+	  emittedInstCounter = 0; // Nothing is left between the first new instruction and newMI.
+	}
+      }
+      if(!ImmReg && !FoldOffset)
+	ImmReg = loadImmediateIntoVirtReg(MI, split, i, Size,&emittedInstCounter);
+      if(ImmReg && !Reused)
+	ConstantRegs[std::make_pair(MO.getImm(), (int)Size)].push_back(ImmReg);
 
       // Immediates.
       if(isRI(MI->getOpcode())){
       	emitNewInstructionRItoRR(MI, NewOpcode, ImmReg);
-	flagImmediate = 1;
       }
 
-      if(isMI(MI->getOpcode()) && i == 5){ // 5 is the index of an immediate in a *mi instruction.
+      if(isMI(MI->getOpcode()) && i == 5){
       	emitNewInstructionMItoMR(MI, NewOpcode, ImmReg);
-	flagImmediate = 1;
       }
 
       // Offsets.
-      if(isMI(MI->getOpcode()) && i == 3){ // 3 is the index of an offset in a *mi instruction.
-      	emitAddInstSubRegToReg(MI, NewOpcode, ImmReg, 0, i);
-      }
-      if(isLEA(MI->getOpcode())){
-      	MI->clearKillInfo();
-      	emitAddInstSubRegToReg(MI, NewOpcode, ImmReg, 1, i);      
-      }
-      if(isRM(MI->getOpcode())){
-      	emitAddInstSubRegToReg(MI, NewOpcode, ImmReg, 1, i);
-      }
-      if(isMR(MI->getOpcode())){
-      	emitAddInstSubRegToReg(MI, NewOpcode, ImmReg, 0, i);
+      if(!flagImmediate){
+	if(FoldOffset){
+	  ++FoldedOffsets;
+	  emitLEAOffset(MI, 0, BaseRegIndex, split.first, split.second);
+	}
+	else
+	  emitLEAOffset(MI, ImmReg, BaseRegIndex, 0, 0);
       }
 
       // Erase the old instruction and update iterators. At this point
       // MBBI still points to the original MI.
-      MachineInstr *NewMI;
-      if(flagImmediate){
-	NewMI = std::prev(MBBI); 
-	MBBI = NewMI;
-      }
-      else{
-	NewMI = std::prev(MBBI,2); // Skips the sub.
-	MBBI = std::prev(MBBI); // Points to the sub.
-      }
+      MachineInstr *NewMI = std::prev(MBBI);
+      MBBI = NewMI;
       MI->eraseFromParent();
 
       // EFLAGS handling.
@@ -520,51 +1200,34 @@ bool GFreeImmediateReconPass::runOnMachineBasicBlock() {
 	 If we handled an immediate the layout can be:
 	 mov, or, newMI <-- MBBI, (deleted MI) (emittedInstCounter =  2) otherwise
 	 mov, mov, or, newMI <-- MBBI, (deleted MI) (emittedInstCounter =  3) 
+	 (or mov, not / mov, lea / mov, subreg_to_reg, lea, which leave the
+	 flags alone, or nothing at all if the mov/or were hoisted).
 	 
 	 If we handled an offset the layout can be:
-	 mov, or, add, newMI, sub <-- MBBI, (deleted MI) (emittedInstCounter =  2) otherwise 
-	 mov, mov, or, add, newMI, sub <-- MBBI, (deleted MI) (emittedInstCounter =  3) 
+	 mov, or, lea, newMI <-- MBBI, (deleted MI) (emittedInstCounter =  2) otherwise 
+	 mov, mov, or, lea, newMI <-- MBBI, (deleted MI) (emittedInstCounter =  3) 
+	 (or just lea, newMI if the offset was folded).
       */
 
-
-      if( std::next(MBBI) == MBB->end() ) // newMI/SUB is the last instruction of this MBB, check in the next MBB.
-	pushEFLAGS = needToSaveEFLAGS( (*MBB->succ_begin())->begin() );
-      else
-	pushEFLAGS = needToSaveEFLAGS(std::next(MBBI));
-
-      if( !pushEFLAGS ) continue;
-
-      GFreeDEBUG(0, "> Push/Pop EFLAGS\n");	
-      unsigned int saveRegEFLAGS = MF->getRegInfo().createVirtualRegister(&X86::GR64RegClass);
-      
-      if(flagImmediate){ 
-	pushEFLAGSinline( std::prev(MBBI,emittedInstCounter), saveRegEFLAGS ); // Before the first mov
-	popEFLAGSinline ( MBBI, saveRegEFLAGS ); // Before newMI
-	continue;
+      // Only the or can clobber the flags: save them if they are live
+      // before (the original) MI. The lea and newMI are left alone.
+      if(LiveBefore && FlagsClobbered){
+	MachineBasicBlock::iterator End = flagImmediate ? MBBI : std::prev(MBBI);
+	saveEFLAGS(std::prev(End,emittedInstCounter), End); // Before the first mov, after the or.
       }
 
-      bool useEFLAGS = NewMI->readsRegister(X86::EFLAGS);
-      bool defineEFLAGS = NewMI->definesRegister(X86::EFLAGS);
-
-      if(!defineEFLAGS && !useEFLAGS){  // i.e. LEA
-	pushEFLAGSinline( std::prev(MBBI,2+emittedInstCounter),saveRegEFLAGS ); // Before first mov
-	popEFLAGSinline ( std::next(MBBI), saveRegEFLAGS ); // After sub;		
+      // Keep the liveness up to date for the instructions we emitted.
+      MachineBasicBlock::iterator FirstNew = AtBegin ? MBB->begin() : std::next(PrevMBBI);
+      if(DeadPt == MI)
+	DeadPt = FirstNew;
+      for(MachineBasicBlock::iterator I = NextMBBI; I != FirstNew; ){
+	--I;
+	EFLAGSLiveness.addInstr(I);
       }
-      else if(!defineEFLAGS && useEFLAGS){ // i.e. CMOV
-	pushEFLAGSinline( std::prev(MBBI,2+emittedInstCounter), saveRegEFLAGS ); // Before first mov
-	popEFLAGSinline( std::prev(MBBI), saveRegEFLAGS ); // Before newMI
 
-	pushEFLAGSinline ( MBBI, saveRegEFLAGS ); // Before sub;
-	popEFLAGSinline ( std::next(MBBI), saveRegEFLAGS ); // After sub;	
-      }
-      else if(defineEFLAGS && !useEFLAGS){ // i.e. CMP
-	pushEFLAGSinline ( MBBI, saveRegEFLAGS ); // Before sub;
-	popEFLAGSinline ( std::next(MBBI), saveRegEFLAGS ); // After sub;	
-      }
-      else if(defineEFLAGS && useEFLAGS){ // i.e. ADC 
-	pushEFLAGSinline( std::prev(MBBI,2+emittedInstCounter), saveRegEFLAGS ); // Before first mov
-	popEFLAGSinline( std::prev(MBBI), saveRegEFLAGS ); // Before newMI
-      }
+      // MI is gone, look at newMI again.
+      ResumeMBBI = NewMI;
+      break;
     }
   }  
   return true;
@@ -1,13 +1,20 @@
 #include "X86.h"
 #include "X86Subtarget.h"
 #include "X86InstrBuilder.h"
+#include "llvm/CodeGen/LivePhysRegs.h"
+#include "llvm/CodeGen/MachineDominators.h"
 #include "llvm/CodeGen/MachineFunctionPass.h"
+#include "llvm/CodeGen/MachineLoopInfo.h"
+#include "llvm/CodeGen/MachinePostDominators.h"
 #include "llvm/CodeGen/MachineRegisterInfo.h"
 #include "llvm/Support/raw_ostream.h"
 #include "llvm/Support/Format.h"
 #include "llvm/MC/MCContext.h"
 #include "X86GFreeUtils.h"
+#include "X86GFreeConstSynth.h"
+#include "llvm/ADT/SmallPtrSet.h"
 #include "llvm/ADT/Statistic.h"
+#include "llvm/Support/CommandLine.h"
 #include <stdlib.h> 
 #include <time.h>   
 #include "llvm/Support/Format.h"
@@ -16,13 +23,26 @@ using namespace llvm;
 //  Then, on the command line, you can specify '-debug-only=foo'
 #define DEBUG_TYPE "gfreeimmediaterecon"
 STATISTIC(Jcp , "Number of cookies for call*/jmp* inserted");
+STATISTIC(JcpScratch , "Number of cookie checks using a dead scratch register");
+STATISTIC(JcpSaved , "Number of cookie checks saving r11 on the stack");
+STATISTIC(JcpShrinkWrapped , "Number of cookies initialized out of the entry block");
 
 namespace {
   class GFreeJCPPass : public MachineFunctionPass {
   public:
     GFreeJCPPass() : MachineFunctionPass(ID) {}
     bool runOnMachineFunction(MachineFunction &MF) override;
+    void getAnalysisUsage(AnalysisUsage &AU) const override {
+      AU.addRequired<MachineDominatorTree>();
+      AU.addRequired<MachinePostDominatorTree>();
+      AU.addRequired<MachineLoopInfo>();
+      AU.setPreservesCFG();
+      MachineFunctionPass::getAnalysisUsage(AU);
+    }
     const char *getPassName() const override {return "Jump Control Protection Pass";}
+  private:
+    MachineBasicBlock *findCookieBlock(MachineFunction &MF,
+				       SmallPtrSetImpl<MachineBasicBlock *> &CheckBlocks);
     static char ID;
   };
   char GFreeJCPPass::ID = 0;
@@ -30,27 +50,79 @@ namespace {
 
 int64_t GFreeCookieCostant;
 
+static cl::opt<bool> GFreeJCPNoShrinkWrap("gfree-jcp-no-shrink-wrap", cl::Hidden,
+	       cl::desc("Always initialize the JCP cookie in the entry block"));
+
 FunctionPass *llvm::createGFreeJCPPass() {
   return new GFreeJCPPass();
 }
 
-// Put the cookie on the stack at the beginning of a function.
-void insertCookieIndirectJump(MachineInstr* MI, int index){
-  MachineBasicBlock *MBB =  MI->getParent();
+// The liveness right before Pos in MBB.
+static void getLiveRegsBefore(MachineBasicBlock *MBB, MachineBasicBlock::iterator Pos,
+			      LivePhysRegs &LiveRegs){
+  LiveRegs.addLiveOuts(MBB);
+  for(MachineBasicBlock::iterator I = MBB->end(); I != Pos; ){
+    --I;
+    LiveRegs.stepBackward(*I);
+  }
+}
+
+// True if the flags might be live right before Pos in MBB.
+static bool isFlagsLive(MachineBasicBlock *MBB, MachineBasicBlock::iterator Pos){
+  MachineFunction *MF = MBB->getParent();
+  if(!MF->getRegInfo().tracksLiveness())
+    return true;
+  LivePhysRegs LiveRegs(MF->getSubtarget().getRegisterInfo());
+  getLiveRegsBefore(MBB, Pos, LiveRegs);
+  return LiveRegs.contains(X86::EFLAGS);
+}
+
+// A caller saved GPR that is dead right before Pos in MBB, 0 if there is
+// none. A call clobbers them anyway, so the usual case is to find one. The
+// callee saved ones are never used: the prologue wouldn't save them.
+static unsigned int getScratchRegister(MachineBasicBlock *MBB, MachineBasicBlock::iterator Pos,
+				       unsigned int Exclude = 0){
+  MachineFunction *MF = MBB->getParent();
+  const TargetRegisterInfo *TRI = MF->getSubtarget().getRegisterInfo();
+  const MachineRegisterInfo &MRI = MF->getRegInfo();
+  // r11 and r10 first, they never carry arguments.
+  static const unsigned int Candidates[] = {
+    X86::R11, X86::R10, X86::R9, X86::R8, X86::RCX,
+    X86::RDX, X86::RSI, X86::RDI, X86::RAX
+  };
+
+  if(!MRI.tracksLiveness())
+    return 0;
+
+  LivePhysRegs LiveRegs(TRI);
+  getLiveRegsBefore(MBB, Pos, LiveRegs);
+
+  for(unsigned int Reg : Candidates){
+    if(MRI.isReserved(Reg) || Reg == Exclude)
+      continue;
+    bool Live = false;
+    for(MCRegAliasIterator AI(Reg, TRI, true); AI.isValid() && !Live; ++AI)
+      Live = LiveRegs.contains(*AI);
+    if(!Live)
+      return Reg;
+  }
+  return 0;
+}
+
+// Put the cookie on the stack before MI, in ScratchReg.
+void insertCookieIndirectJump(MachineBasicBlock *MBB, MachineBasicBlock::iterator MI,
+			      int index, unsigned int ScratchReg){
   MachineFunction *MF = MBB->getParent();
   const X86Subtarget &STI = MF->getSubtarget<X86Subtarget>();
   const X86InstrInfo &TII = *STI.getInstrInfo();
-  DebugLoc DL = MI->getDebugLoc();
+  DebugLoc DL = MI != MBB->end() ? MI->getDebugLoc() : DebugLoc();
   MachineInstrBuilder MIB; 
 
   // unsigned int VirtReg = MF->getRegInfo().createVirtualRegister(&X86::GR64RegClass);
   // unsigned int UselessReg = MF->getRegInfo().createVirtualRegister(&X86::GR64RegClass);
 
-  // Here we are in the prologue of a function, R11 can be clobbered.
-  unsigned int VirtReg = X86::R11;
-  unsigned int UselessReg = X86::R11;
-  MBB->addLiveIn(X86::R11);
-  MBB->sortUniqueLiveIns();
+  unsigned int VirtReg = ScratchReg;
+  unsigned int UselessReg = ScratchReg;
 
   // mov $imm, %VirtReg
   MIB = BuildMI(*MBB, MI, DL, TII.get(X86::MOV64ri)).addReg(VirtReg, RegState::Define);
@@ -90,13 +162,29 @@ void insertCheckCookieIndirectJump(MachineInstr* MI, int index){
   // unsigned int VirtReg = MF->getRegInfo().createVirtualRegister(&X86::GR64RegClass);
   // unsigned int TmpReg = MF->getRegInfo().createVirtualRegister(&X86::GR64RegClass);
 
-  unsigned int VirtReg = X86::R11; 
-  unsigned int TmpReg = X86::R11; 
-  MBB->addLiveIn(X86::R11);
-  MBB->sortUniqueLiveIns();
+  // Before a tail call the check is split by the epilogue (see
+  // cookieProtectionFinalization): the register must survive it and the
+  // return address decryption, which uses its own scratch register.
+  unsigned int ScratchReg = getScratchRegister(MBB, MI,
+			      isTailCall(MI) ? getReturnAddressScratchReg(MI) : 0);
+  bool Saved = ScratchReg == 0;
+  if(Saved){
+    ScratchReg = X86::R11;
+    MBB->addLiveIn(X86::R11);
+    MBB->sortUniqueLiveIns();
+    ++JcpSaved;
+  }
+  else
+    ++JcpScratch;
+  GFreeDEBUG(1, "[JCP] scratch register: " << 
+	     MF->getSubtarget().getRegisterInfo()->getName(ScratchReg) << "\n");
+
+  unsigned int VirtReg = ScratchReg; 
+  unsigned int TmpReg = ScratchReg; 
 
-  // Here we are in the middle of a function, so r11 can't be clobbered.
-  pushReg(MI,X86::R11, RegState::Undef);
+  // No dead register here, so r11 can't be clobbered.
+  if(Saved)
+    pushReg(MI,X86::R11, RegState::Undef);
 
   // mov $imm, %VirtReg
   MIB = BuildMI(*MBB, MI, DL, TII.get(X86::MOV64ri)).addReg(VirtReg, RegState::Define);
@@ -109,31 +197,64 @@ void insertCheckCookieIndirectJump(MachineInstr* MI, int index){
   GFreeDEBUG(2, "> " << *MIB);
 
   // cmp VirtReg, fs:0x28
-  MIB = BuildMI(*MBB, MI, DL, TII.get(X86::CMP64rm)).addReg(TmpReg)
+  MIB = BuildMI(*MBB, MI, DL, TII.get(X86::CMP64rm)).addReg(TmpReg, RegState::Kill)
     .addReg(0).addImm(1).addReg(0).addImm(0x28).addReg(X86::FS);
   GFreeDEBUG(2, "> " << *MIB);
 
-  popReg(MI,X86::R11);
+  if(Saved)
+    popReg(MI,X86::R11);
 
   // MIB = BuildMI(*MBB, MI, DL, TII.get(X86::NOOP));
   // GFreeDEBUG(2, "> " << *MIB);
 
 }
 
+// The cookie must stay a single movabs (cookieProtectionFinalization looks
+// for it), so it can't be synthesized: draw until the movabs is safe.
 int64_t generateSafeRandom(){
-  std::pair<int64_t, int64_t> tmp_pair;
   int64_t rnd;
   do{
     rnd = rand();
     rnd = (rnd << 32) | rand();
-    tmp_pair = splitInt(rnd,64);
-  }while((tmp_pair.first != 0)); // If true it means splitInt found an evil bytes.
+  }while(!GFreeConstantSynthesizer::isSafe(rnd, 8));
 
   // errs() << format("rnd=0x%016llx\n",rnd);
 
   return rnd;
 }
 
+// The block where the cookie is initialized: the nearest common dominator
+// of the blocks with a jmp*/call*, so the paths that never reach one don't
+// pay for it. It's hoisted out of the loops, and back to the entry when
+// every execution would go through it anyway. Since it dominates every
+// check, a check can still pass only if the function ran from its entry
+// down to the initialization.
+MachineBasicBlock *GFreeJCPPass::findCookieBlock(MachineFunction &MF,
+						 SmallPtrSetImpl<MachineBasicBlock *> &CheckBlocks){
+  MachineDominatorTree &MDT = getAnalysis<MachineDominatorTree>();
+  MachinePostDominatorTree &MPDT = getAnalysis<MachinePostDominatorTree>();
+  MachineLoopInfo &MLI = getAnalysis<MachineLoopInfo>();
+  MachineBasicBlock *Entry = &MF.front();
+  MachineBasicBlock *CookieMBB = nullptr;
+
+  if(GFreeJCPNoShrinkWrap)
+    return Entry;
+
+  for(MachineBasicBlock *CheckMBB : CheckBlocks)
+    CookieMBB = CookieMBB ? MDT.findNearestCommonDominator(CookieMBB, CheckMBB) : CheckMBB;
+
+  while(CookieMBB != Entry && MLI.getLoopFor(CookieMBB)){
+    MachineDomTreeNode *IDom = MDT.getNode(MLI.getLoopFor(CookieMBB)->getHeader())->getIDom();
+    if(!IDom)
+      return Entry;
+    CookieMBB = IDom->getBlock();
+  }
+
+  if(MPDT.dominates(CookieMBB, Entry))
+    return Entry;
+  return CookieMBB;
+}
+
 // Main.
 bool GFreeJCPPass::runOnMachineFunction(MachineFunction &MF) {
   // Generate the random costant for this function
@@ -144,6 +265,7 @@ bool GFreeJCPPass::runOnMachineFunction(MachineFunction &MF) {
   MachineInstr *MI;
 
   std::vector<llvm::MachineInstr*> alreadyCheckedInstr;
+  SmallPtrSet<MachineBasicBlock *, 8> CheckBlocks;
   MachineFrameInfo *MFI = MF.getFrameInfo();
   int index = -1;
   bool created = false;
@@ -170,6 +292,7 @@ bool GFreeJCPPass::runOnMachineFunction(MachineFunction &MF) {
 	}
 
 	insertCheckCookieIndirectJump(MI, index);
+	CheckBlocks.insert(&*MBB);
 	++Jcp; // Update stats.
 
 	// Restart from the right point.
@@ -179,20 +302,40 @@ bool GFreeJCPPass::runOnMachineFunction(MachineFunction &MF) {
     }
   }
 
+  // In this function there is at least one indirect call.
+  if( !created )
+    return true;
+
+  MachineBasicBlock *CookieMBB = findCookieBlock(MF, CheckBlocks);
+  unsigned int ScratchReg = 0;
+  // The xor clobbers the flags. A landing pad is left to the entry: its
+  // labels must come first.
+  MachineBasicBlock::iterator CookiePos = CookieMBB->SkipPHIsAndLabels(CookieMBB->begin());
+  if(CookieMBB != &MF.front() && !CookieMBB->isEHPad() &&
+     !isFlagsLive(CookieMBB, CookiePos))
+    ScratchReg = getScratchRegister(CookieMBB, CookiePos);
+
+  if(ScratchReg){
+    GFreeDEBUG(0, "[!] Adding Cookie @ " << MF.getName() << 
+	       " MBB#" << CookieMBB->getNumber() << "\n");      
+    insertCookieIndirectJump(CookieMBB, CookiePos, index, ScratchReg);
+    ++JcpShrinkWrapped;
+    return true;
+  }
+
   // Skip empty MBBs.
   MBB = MF.begin();
-  while(MBB->empty()){
+  while(MBB != MF.end() && MBB->empty()){
     MBB = std::next(MBB);
   }
 
   if(MBB == MF.end()) return true;
 
-  // In this function there is at least one indirect call.
-  if( created ){
-    GFreeDEBUG(0, "[!] Adding Cookie @ " << MF.getName() << "\n");      
-    MBBI = MBB->begin();
-    insertCookieIndirectJump(MBBI, index);
-  }
+  // Here we are in the prologue of a function, R11 can be clobbered.
+  GFreeDEBUG(0, "[!] Adding Cookie @ " << MF.getName() << "\n");      
+  MBB->addLiveIn(X86::R11);
+  MBB->sortUniqueLiveIns();
+  insertCookieIndirectJump(&*MBB, MBB->begin(), index, X86::R11);
 
   // MF.verify();
   return true;
@@ -0,0 +1,377 @@
+//===-- X86GFreeModRMPredictor.cpp - Predict ModR/M and SIB bytes ---------===//
+//
+//                     The LLVM Compiler Infrastructure
+//
+//===----------------------------------------------------------------------===//
+//
+// This file contains a static predictor of the encoding of a MachineInstr,
+// driven by the X86II form in TSFlags and by the hardware encoding of the
+// registers. It mirrors the rules of X86MCCodeEmitter for the legacy (non
+// VEX/EVEX) forms and lets GFreeModRMSIB answer most of the ret probes
+// without lowering and assembling the instruction.
+//
+//===----------------------------------------------------------------------===//
+
+#include "X86GFreeModRMPredictor.h"
+#include "X86GFreeUtils.h"
+#include "X86.h"
+#include "MCTargetDesc/X86BaseInfo.h"
+#include "MCTargetDesc/X86MCTargetDesc.h"
+
+using namespace llvm;
+
+GFreeModRMPredictor::GFreeModRMPredictor(const TargetInstrInfo *TII, const TargetRegisterInfo *TRI)
+  : TII(TII), TRI(TRI), NeverEvilTable(TII->getNumOpcodes(), -1) {}
+
+static unsigned char ModRMByte(unsigned int Mod, unsigned int RegOpcode, unsigned int RM){
+  return (Mod << 6) | ((RegOpcode & 7) << 3) | (RM & 7);
+}
+
+static void emitConstant(int64_t Val, unsigned int Size, std::vector<unsigned char> &Bytes){
+  for(unsigned int i = 0; i < Size; i++){
+    Bytes.push_back(Val & 0xff);
+    Val >>= 8;
+  }
+}
+
+// Set the REX.R (4), REX.X (2) or REX.B (1) bit if Reg needs it.
+static void setREXBit(GFreePredictedEncoding &Enc, unsigned int Bit, unsigned int Reg){
+  if(Reg && X86II::isX86_64ExtendedReg(Reg))
+    Enc.REX |= 0x40 | Bit;
+}
+
+unsigned int GFreeModRMPredictor::getRegNum(unsigned int Reg){
+  return TRI->getEncodingValue(Reg) & 0x7;
+}
+
+// Escape bytes + base opcode. Returns false for the opcode maps we don't
+// handle (XOP, 3DNow) and for VEX/EVEX encoded instructions.
+bool GFreeModRMPredictor::getOpcodeBytes(uint64_t TSFlags, std::vector<unsigned char> &Bytes){
+  if(TSFlags & X86II::EncodingMask)
+    return false;
+
+  switch(TSFlags & X86II::OpMapMask){
+  case X86II::OB:
+    break;
+  case X86II::TB:
+    Bytes.push_back(0x0f);
+    break;
+  case X86II::T8:
+    Bytes.push_back(0x0f);
+    Bytes.push_back(0x38);
+    break;
+  case X86II::TA:
+    Bytes.push_back(0x0f);
+    Bytes.push_back(0x3a);
+    break;
+  default:
+    return false;
+  }
+  Bytes.push_back(X86II::getBaseOpcodeFor(TSFlags));
+  return true;
+}
+
+// Emit the ModR/M, the SIB and the displacement of the memory operand
+// starting at MemOp. This follows X86MCCodeEmitter::emitMemModRMByte for
+// the 64-bit mode.
+bool GFreeModRMPredictor::emitMemory(const MachineInstr *MI, const std::vector<unsigned int> &PhysRegs,
+				     unsigned int MemOp, unsigned int RegField, GFreePredictedEncoding &Enc){
+  if(MemOp + X86::AddrNumOperands > MI->getNumOperands())
+    return false;
+
+  const MachineOperand &Disp = MI->getOperand(MemOp + X86::AddrDisp);
+  const MachineOperand &Scale = MI->getOperand(MemOp + X86::AddrScaleAmt);
+  if(!Disp.isImm() || !Scale.isImm())
+    return false;
+
+  unsigned int BaseReg = PhysRegs[MemOp + X86::AddrBaseReg];
+  unsigned int IndexReg = PhysRegs[MemOp + X86::AddrIndexReg];
+  int64_t DispVal = Disp.getImm();
+
+  // 16-bit addressing has its own table, leave it to the assembler.
+  if((BaseReg && X86::GR16RegClass.contains(BaseReg)) ||
+     (IndexReg && X86::GR16RegClass.contains(IndexReg)))
+    return false;
+
+  Enc.HasModRM = true;
+  std::vector<unsigned char> &Bytes = Enc.Bytes;
+
+  // RIP relative.
+  if(BaseReg == X86::RIP){
+    if(IndexReg)
+      return false;
+    Enc.ModRM = ModRMByte(0, RegField, 5);
+    Bytes.push_back(Enc.ModRM);
+    emitConstant(DispVal, 4, Bytes);
+    return true;
+  }
+
+  unsigned int BaseRegNo = BaseReg ? getRegNum(BaseReg) : -1U;
+  setREXBit(Enc, 1, BaseReg);
+  setREXBit(Enc, 2, IndexReg);
+
+  // No SIB byte.
+  if(IndexReg == 0 && BaseReg != 0 && BaseRegNo != 4 /* ESP/R12 */){
+    if(DispVal == 0 && BaseRegNo != 5 /* EBP/R13 */){
+      Enc.ModRM = ModRMByte(0, RegField, BaseRegNo);
+      Bytes.push_back(Enc.ModRM);
+    }
+    else if(isInt<8>(DispVal)){
+      Enc.ModRM = ModRMByte(1, RegField, BaseRegNo);
+      Bytes.push_back(Enc.ModRM);
+      emitConstant(DispVal, 1, Bytes);
+    }
+    else{
+      Enc.ModRM = ModRMByte(2, RegField, BaseRegNo);
+      Bytes.push_back(Enc.ModRM);
+      emitConstant(DispVal, 4, Bytes);
+    }
+    return true;
+  }
+
+  // We need a SIB byte.
+  static const unsigned int SSTable[] = { -1U, 0, 1, -1U, 2, -1U, -1U, -1U, 3 };
+  int64_t ScaleVal = Scale.getImm();
+  if(ScaleVal < 1 || ScaleVal > 8 || SSTable[ScaleVal] == -1U)
+    return false;
+  unsigned int SS = SSTable[ScaleVal];
+  unsigned int IndexRegNo = IndexReg ? getRegNum(IndexReg) : 4; // 4 means no index.
+  unsigned int DispSize;
+
+  Enc.HasSIB = true;
+  if(BaseReg == 0){
+    // [disp32 + index*scale]
+    Enc.ModRM = ModRMByte(0, RegField, 4);
+    Enc.SIB = ModRMByte(SS, IndexRegNo, 5);
+    DispSize = 4;
+  }
+  else{
+    if(DispVal == 0 && BaseRegNo != 5){
+      Enc.ModRM = ModRMByte(0, RegField, 4);
+      DispSize = 0;
+    }
+    else if(isInt<8>(DispVal)){
+      Enc.ModRM = ModRMByte(1, RegField, 4);
+      DispSize = 1;
+    }
+    else{
+      Enc.ModRM = ModRMByte(2, RegField, 4);
+      DispSize = 4;
+    }
+    Enc.SIB = ModRMByte(SS, IndexRegNo, BaseRegNo);
+  }
+  Bytes.push_back(Enc.ModRM);
+  Bytes.push_back(Enc.SIB);
+  emitConstant(DispVal, DispSize, Bytes);
+  return true;
+}
+
+bool GFreeModRMPredictor::predictEncoding(const MachineInstr *MI, const std::vector<unsigned int> &PhysRegs,
+					  GFreePredictedEncoding &Enc){
+  const MCInstrDesc &Desc = MI->getDesc();
+  uint64_t TSFlags = Desc.TSFlags;
+  unsigned int Form = TSFlags & X86II::FormMask;
+  unsigned int NumOps = Desc.getNumOperands();
+
+  if(Desc.isPseudo() || Form == X86II::Pseudo || NumOps > MI->getNumOperands())
+    return false;
+  if(X86II::isImmPCRel(TSFlags))
+    return false;
+  if(!getOpcodeBytes(TSFlags, Enc.Bytes))
+    return false;
+
+  // The bias skips the tied source, as X86MCCodeEmitter::encodeInstruction
+  // does. It skips more than that only for gathers and scatters.
+  unsigned int CurOp = X86II::getOperandBias(Desc);
+  bool TiedSource = NumOps > 1 && Desc.getOperandConstraint(1, MCOI::TIED_TO) == 0;
+  if(CurOp != (TiedSource ? 1U : 0U))
+    return false;
+
+  if(TSFlags & X86II::REX_W)
+    Enc.REX |= 0x48;
+
+  switch(Form){
+  default:
+    return false;
+
+  case X86II::RawFrm:
+    break;
+
+  case X86II::AddRegFrm:
+    if(!PhysRegs[CurOp])
+      return false;
+    setREXBit(Enc, 1, PhysRegs[CurOp]);
+    Enc.Bytes.back() += getRegNum(PhysRegs[CurOp++]);
+    break;
+
+  case X86II::MRMDestReg:
+    if(!PhysRegs[CurOp] || !PhysRegs[CurOp+1])
+      return false;
+    setREXBit(Enc, 4, PhysRegs[CurOp+1]);
+    setREXBit(Enc, 1, PhysRegs[CurOp]);
+    Enc.HasModRM = true;
+    Enc.ModRM = ModRMByte(3, getRegNum(PhysRegs[CurOp+1]), getRegNum(PhysRegs[CurOp]));
+    Enc.Bytes.push_back(Enc.ModRM);
+    CurOp += 2;
+    break;
+
+  case X86II::MRMSrcReg:
+    if(!PhysRegs[CurOp] || !PhysRegs[CurOp+1])
+      return false;
+    setREXBit(Enc, 4, PhysRegs[CurOp]);
+    setREXBit(Enc, 1, PhysRegs[CurOp+1]);
+    Enc.HasModRM = true;
+    Enc.ModRM = ModRMByte(3, getRegNum(PhysRegs[CurOp]), getRegNum(PhysRegs[CurOp+1]));
+    Enc.Bytes.push_back(Enc.ModRM);
+    CurOp += 2;
+    break;
+
+  case X86II::MRMXr:
+  case X86II::MRM0r: case X86II::MRM1r:
+  case X86II::MRM2r: case X86II::MRM3r:
+  case X86II::MRM4r: case X86II::MRM5r:
+  case X86II::MRM6r: case X86II::MRM7r:
+    if(!PhysRegs[CurOp])
+      return false;
+    setREXBit(Enc, 1, PhysRegs[CurOp]);
+    Enc.HasModRM = true;
+    Enc.ModRM = ModRMByte(3, Form == X86II::MRMXr ? 0 : Form - X86II::MRM0r,
+			  getRegNum(PhysRegs[CurOp]));
+    Enc.Bytes.push_back(Enc.ModRM);
+    CurOp++;
+    break;
+
+  case X86II::MRMDestMem:
+    if(!PhysRegs[CurOp + X86::AddrNumOperands])
+      return false;
+    setREXBit(Enc, 4, PhysRegs[CurOp + X86::AddrNumOperands]);
+    if(!emitMemory(MI, PhysRegs, CurOp, getRegNum(PhysRegs[CurOp + X86::AddrNumOperands]), Enc))
+      return false;
+    CurOp += X86::AddrNumOperands + 1;
+    break;
+
+  case X86II::MRMSrcMem:
+    if(!PhysRegs[CurOp])
+      return false;
+    setREXBit(Enc, 4, PhysRegs[CurOp]);
+    if(!emitMemory(MI, PhysRegs, CurOp+1, getRegNum(PhysRegs[CurOp]), Enc))
+      return false;
+    CurOp += X86::AddrNumOperands + 1;
+    break;
+
+  case X86II::MRMXm:
+  case X86II::MRM0m: case X86II::MRM1m:
+  case X86II::MRM2m: case X86II::MRM3m:
+  case X86II::MRM4m: case X86II::MRM5m:
+  case X86II::MRM6m: case X86II::MRM7m:
+    if(!emitMemory(MI, PhysRegs, CurOp, Form == X86II::MRMXm ? 0 : Form - X86II::MRM0m, Enc))
+      return false;
+    CurOp += X86::AddrNumOperands;
+    break;
+  }
+
+  // Immediate, if any, follows the operands we consumed.
+  unsigned int ImmSize = X86II::getSizeOfImm(TSFlags);
+  if(ImmSize){
+    if(CurOp >= NumOps || !MI->getOperand(CurOp).isImm())
+      return false;
+    emitConstant(MI->getOperand(CurOp).getImm(), ImmSize, Enc.Bytes);
+  }
+  return true;
+}
+
+int GFreeModRMPredictor::predictContainsRet(const MachineInstr *MI, const std::vector<unsigned int> &PhysRegs){
+  switch(MI->getOpcode()){
+  case TargetOpcode::KILL:
+  case TargetOpcode::IMPLICIT_DEF:
+  case TargetOpcode::DBG_VALUE:
+    return 0; // Never assembled.
+  case TargetOpcode::COPY: {
+    // A GPR copy is lowered to a MOV*rr (MRMDestReg, 0x88/0x89).
+    unsigned int Dst = PhysRegs[0];
+    unsigned int Src = PhysRegs[1];
+    if(!Dst || !Src)
+      return -1;
+    if(Dst == Src || MI->allDefsAreDead())
+      return 0;
+    unsigned char Opcode;
+    if(X86::GR64RegClass.contains(Dst) && X86::GR64RegClass.contains(Src)) Opcode = 0x89;
+    else if(X86::GR32RegClass.contains(Dst) && X86::GR32RegClass.contains(Src)) Opcode = 0x89;
+    else if(X86::GR16RegClass.contains(Dst) && X86::GR16RegClass.contains(Src)) Opcode = 0x89;
+    else if(X86::GR8RegClass.contains(Dst) && X86::GR8RegClass.contains(Src)) Opcode = 0x88;
+    else return -1;
+    std::vector<unsigned char> Bytes = {Opcode, ModRMByte(3, getRegNum(Src), getRegNum(Dst))};
+    return containsRet(Bytes);
+  }
+  }
+
+  if(neverEncodesRet(MI->getOpcode()))
+    return 0;
+
+  GFreePredictedEncoding Enc;
+  if(!predictEncoding(MI, PhysRegs, Enc))
+    return -1;
+  return containsRet(Enc.Bytes);
+}
+
+// An opcode never encodes a ret if it has no immediate and no displacement
+// and none of the register combinations produces an evil ModR/M (or an evil
+// opcode, for AddRegFrm).
+bool GFreeModRMPredictor::neverEncodesRet(unsigned int Opcode){
+  if(NeverEvilTable[Opcode] != -1)
+    return NeverEvilTable[Opcode];
+
+  NeverEvilTable[Opcode] = 0;
+  const MCInstrDesc &Desc = TII->get(Opcode);
+  uint64_t TSFlags = Desc.TSFlags;
+  unsigned int Form = TSFlags & X86II::FormMask;
+  std::vector<unsigned char> Prefix;
+
+  if(Desc.isPseudo() || X86II::getSizeOfImm(TSFlags) != 0 ||
+     !getOpcodeBytes(TSFlags, Prefix))
+    return false;
+
+  // The values of the reg and r/m fields to try.
+  unsigned int RegFieldBegin = 0, RegFieldEnd = 8;
+  switch(Form){
+  default:
+    return false;
+  case X86II::RawFrm:
+    NeverEvilTable[Opcode] = !containsRet(Prefix);
+    return NeverEvilTable[Opcode];
+  case X86II::AddRegFrm: {
+    for(unsigned int r = 0; r < 8; r++){
+      std::vector<unsigned char> Bytes(Prefix);
+      Bytes.back() += r;
+      if(containsRet(Bytes))
+	return false;
+    }
+    NeverEvilTable[Opcode] = 1;
+    return true;
+  }
+  case X86II::MRMDestReg:
+  case X86II::MRMSrcReg:
+    break;
+  case X86II::MRMXr:
+    RegFieldEnd = 1;
+    break;
+  case X86II::MRM0r: case X86II::MRM1r:
+  case X86II::MRM2r: case X86II::MRM3r:
+  case X86II::MRM4r: case X86II::MRM5r:
+  case X86II::MRM6r: case X86II::MRM7r:
+    RegFieldBegin = Form - X86II::MRM0r;
+    RegFieldEnd = RegFieldBegin + 1;
+    break;
+  }
+
+  for(unsigned int Reg = RegFieldBegin; Reg < RegFieldEnd; Reg++){
+    for(unsigned int RM = 0; RM < 8; RM++){
+      std::vector<unsigned char> Bytes(Prefix);
+      Bytes.push_back(ModRMByte(3, Reg, RM));
+      if(containsRet(Bytes))
+	return false;
+    }
+  }
+  NeverEvilTable[Opcode] = 1;
+  return true;
+}
@@ -0,0 +1,57 @@
+#ifndef GFREEMODRMPREDICTOR_H_
+#define GFREEMODRMPREDICTOR_H_
+
+#include "llvm/CodeGen/MachineInstr.h"
+#include "llvm/Target/TargetInstrInfo.h"
+#include "llvm/Target/TargetRegisterInfo.h"
+#include <vector>
+
+namespace llvm {
+
+  // Static predictor for the bytes that matter for a ret probe: opcode
+  // (with its escape bytes), ModR/M, SIB, displacement and immediate.  The
+  // legacy prefixes and REX can never be (or precede) an evil byte, so
+  // they are computed only for debugging.
+  // It works only with physical registers: the caller passes, for each
+  // operand of MI, the physical register it will be rewritten to (0 for non
+  // register operands).
+  class GFreePredictedEncoding {
+  public:
+    unsigned char REX;
+    unsigned char ModRM;
+    unsigned char SIB;
+    bool HasModRM;
+    bool HasSIB;
+    std::vector<unsigned char> Bytes;
+    GFreePredictedEncoding() : REX(0), ModRM(0), SIB(0), HasModRM(false), HasSIB(false) {}
+  };
+
+  class GFreeModRMPredictor {
+  public:
+    GFreeModRMPredictor(const TargetInstrInfo *TII, const TargetRegisterInfo *TRI);
+
+    // Returns 1 if MI encodes a ret, 0 if it doesn't and -1 if the predictor
+    // can't handle this form (and the caller must assemble MI).
+    int predictContainsRet(const MachineInstr *MI, const std::vector<unsigned int> &PhysRegs);
+
+    // Returns true if the opcode can never encode a ret, whatever registers
+    // are allocated. The answer is computed once per opcode.
+    bool neverEncodesRet(unsigned int Opcode);
+
+    bool predictEncoding(const MachineInstr *MI, const std::vector<unsigned int> &PhysRegs,
+			 GFreePredictedEncoding &Enc);
+
+  private:
+    const TargetInstrInfo *TII;
+    const TargetRegisterInfo *TRI;
+    // -1: not computed yet, 0: may encode a ret, 1: never encodes a ret.
+    std::vector<signed char> NeverEvilTable;
+
+    bool getOpcodeBytes(uint64_t TSFlags, std::vector<unsigned char> &Bytes);
+    bool emitMemory(const MachineInstr *MI, const std::vector<unsigned int> &PhysRegs,
+		    unsigned int MemOp, unsigned int RegField, GFreePredictedEncoding &Enc);
+    unsigned int getRegNum(unsigned int Reg);
+  };
+
+}
+#endif
@@ -1,8 +1,11 @@
 #include "X86GFreeAssembler.h"
+#include "X86GFreeModRMPredictor.h"
 #include "X86GFreeUtils.h"
 #include "X86.h"
+#include "X86Subtarget.h"
 #include "llvm/CodeGen/MachineFunction.h"
 #include "llvm/CodeGen/MachineFunctionPass.h"
+#include "llvm/IR/Function.h"
 #include "llvm/Support/raw_ostream.h"
 #include "llvm/Support/TargetRegistry.h"
 #include "llvm/ADT/Statistic.h"
@@ -12,45 +15,142 @@
 #include "llvm/CodeGen/LiveInterval.h"
 #include "llvm/CodeGen/MachineInstrBuilder.h"
 #include "./llvm/CodeGen/LiveIntervalAnalysis.h"
+#include "llvm/ADT/Hashing.h"
+#include "llvm/ADT/SmallPtrSet.h"
 #include <set>
 #include <list>
+#include <unordered_map>
+#include <deque>
+#include <chrono>
 
 using namespace llvm;
 
 #define DEBUG_TYPE "gfreemodrmsib"
 STATISTIC(EvilSib , "Number of modified instruction because of an evil ModRM/SIB");
+STATISTIC(VectorSafeRegs, "Number of evil vector instructions fixed with a saved safe XMM/YMM register");
+STATISTIC(EncodingCacheHit , "Number of ret probes answered by the encoding cache");
+STATISTIC(EncodingCacheMiss, "Number of ret probes that required assembling");
+
+STATISTIC(PredictorHit     , "Number of ret probes answered by the ModRM/SIB predictor");
+STATISTIC(PredictorFallback, "Number of ret probes the ModRM/SIB predictor can't handle");
+STATISTIC(PredictorPruned  , "Number of instructions skipped because their opcode never encodes a ret");
+STATISTIC(PredictorMismatch, "Number of ModRM/SIB predictions that differ from the assembler");
+STATISTIC(PredictorUntrusted, "Number of opcodes whose first ModRM/SIB prediction differs from the assembler");
+
+static cl::opt<bool> GFreeNoPredictor("gfree-no-modrm-predictor", cl::Hidden,
+	       cl::desc("Always assemble the instruction instead of predicting its ModRM/SIB"));
+
+static cl::opt<bool> GFreeVerifyPredictor("gfree-verify-modrm-predictor", cl::Hidden,
+	       cl::desc("Cross-check every ModRM/SIB prediction against the assembler"));
+
+STATISTIC(WorklistVisits   , "Number of instructions visited by the ModRM/SIB worklist");
+STATISTIC(BudgetExceeded   , "Number of functions that exceeded the ModRM/SIB reallocation budget");
+STATISTIC(VisitsCapped     , "Number of instructions that reached the ModRM/SIB visit cap");
+
+static cl::opt<unsigned> GFreeModRMMaxVisits("gfree-modrm-max-visits", cl::Hidden, cl::init(4),
+	       cl::desc("Max number of worklist visits per instruction before "
+			"GFreeModRMSIB stops reallocating for it and only does code transformations"));
+
+static cl::opt<unsigned> GFreeModRMTimeBudget("gfree-modrm-time-budget", cl::Hidden, cl::init(0),
+	       cl::desc("Time budget (in ms) per function for the ModRM/SIB register "
+			"reallocation, 0 means no limit"));
+
+STATISTIC(JointPairRealloc , "Number of evil instructions fixed by reallocating two registers at once");
+STATISTIC(EvictionRealloc  , "Number of evil instructions fixed by evicting interfering live ranges");
+
+static cl::opt<bool> GFreeNoJointRealloc("gfree-no-joint-realloc", cl::Hidden,
+	       cl::desc("Don't try register pairs and evictions before the ModRM/SIB code transformation"));
+
+static cl::opt<unsigned> GFreeMaxEvictees("gfree-modrm-max-evictees", cl::Hidden, cl::init(2),
+	       cl::desc("Max number of live ranges evicted to make room for a safe register"));
+
+static cl::opt<unsigned> GFreeMaxEvictSize("gfree-modrm-max-evict-size", cl::Hidden, cl::init(256),
+	       cl::desc("Max size (in slots) of a live range that can be evicted"));
+
+STATISTIC(ScratchVirtRegs  , "Number of evil instructions fixed with a scratch register free across them");
+STATISTIC(XMMSpills        , "Number of safe registers saved in a XMM register instead of the stack");
+
+static cl::opt<bool> GFreeNoScratchReg("gfree-no-modrm-scratch-reg", cl::Hidden,
+	       cl::desc("Always save the safe register with push/pop in the ModRM/SIB code transformation"));
+
+static cl::opt<bool> GFreeNoXMMSpill("gfree-no-modrm-xmm-spill", cl::Hidden,
+	       cl::desc("Don't save the safe register in a free XMM register before using the stack"));
+
+STATISTIC(PrescanSkipped   , "Number of functions without evil ModRM/SIB skipped after the prescan");
+STATISTIC(PrescanEvil      , "Number of evil instructions found by the prescan");
+
+static cl::opt<bool> GFreeNoPrescan("gfree-no-modrm-prescan", cl::Hidden,
+	       cl::desc("Don't encode the whole function upfront, check every instruction in the worklist"));
+
+static cl::opt<bool> GFreeNoEncodingCache("gfree-no-encoding-cache", cl::Hidden,
+	       cl::desc("Always assemble the instruction when probing a new register mapping"));
 
 namespace {
 
+  // The key of the encoding cache is the opcode followed, for each explicit
+  // operand, by its kind and value (physical register after the mapping,
+  // def/dead flags or immediate). Two instructions with the same key are
+  // assembled to the same bytes.
+  typedef std::vector<int64_t> EncodingKey;
+  struct EncodingKeyHash {
+    size_t operator()(const EncodingKey &K) const {
+      return hash_combine_range(K.begin(), K.end());
+    }
+  };
+
   class GFreeModRMSIB : public MachineFunctionPass {
     
   public:
     static char ID;
     VirtRegMap *VRM;
+    MachineRegisterInfo *MRI;
     std::set<unsigned int> VirtRegAlreadyReallocated;
+    // Instructions still to be checked, and a fast membership test.
+    std::deque<MachineInstr*> Worklist;
+    SmallPtrSet<MachineInstr*, 32> InWorklist;
     const TargetRegisterInfo *TRI;
     RegisterClassInfo RegClassInfo;
     LiveRegMatrix *Matrix;
     LiveIntervals *LIS;
     GFreeAssembler *Assembler;
+    // The encoding context behind Assembler, kept for all the functions.
+    std::unique_ptr<GFreeAssembler> AssemblerContext;
+    GFreeModRMPredictor *Predictor;
+    // Per opcode, -1: the predictor was never checked, 0: it got the
+    // encoding wrong, 1: it got it right. An opcode is trusted only after
+    // its first prediction matched the assembler byte for byte.
+    std::vector<signed char> PredictorTrusted;
+    // "Contains ret" verdicts, shared across functions.
+    std::unordered_map<EncodingKey, bool, EncodingKeyHash> EncodingCache;
 
-    GFreeModRMSIB() : MachineFunctionPass(ID) {}
-    bool runOnMachineBasicBlock(MachineBasicBlock &MBB);
+    GFreeModRMSIB() : MachineFunctionPass(ID), Predictor(nullptr) {}
     bool runOnMachineFunction(MachineFunction &MF){
-      MachineFunction::iterator MBB, MBBE;
-      int loop_counter = 0;
-      bool loop_again;
-      do{
-	loop_again = false;
-	for (MBB = MF.begin(), MBBE = MF.end(); MBB != MBBE; ++MBB){
-	  loop_again |= runOnMachineBasicBlock(*MBB);
-	}
-	loop_counter += 1;
-      }while(loop_again);
+      VRM = &getAnalysis<VirtRegMap>();
+      Matrix = &getAnalysis<LiveRegMatrix>();
+      LIS = &getAnalysis<LiveIntervals>();
+      MRI = &MF.getRegInfo();
+      TRI = MF.getSubtarget().getRegisterInfo();
+      RegClassInfo.runOnMachineFunction(VRM->getMachineFunction());
+      // Virtual register numbers are per function.
+      VirtRegAlreadyReallocated.clear();
+      // The encoding context is shared by all the blocks (and functions), we
+      // only rebind it to this function.
+      Assembler = getGFreeAssembler(AssemblerContext, MF, VRM);
+      Predictor = &MF.getSubtarget<X86Subtarget>().getRegisterInfo()->
+	getGFreeModRMPredictor(MF.getSubtarget().getInstrInfo());
+      PredictorTrusted.resize(MF.getSubtarget().getInstrInfo()->getNumOpcodes(), -1);
+
+      runOnWorklist(MF);
 
-      GFreeDEBUG(2, "[MRM][-] On " << MF.getName() << " we did " << loop_counter << " loops\n");
+      // Drop the temporary MBB so the function is not altered.
+      Assembler->release();
       return true;
     }
+
+    bool doFinalization(Module &M) override {
+      AssemblerContext.reset();
+      return false;
+    }
     
     const char *getPassName() const override { return "GFree Mod R/M and SIB bytes handler"; }
 
@@ -64,9 +164,30 @@ namespace {
       MachineFunctionPass::getAnalysisUsage(AU);
     }
 
-    std::vector<unsigned char> AssembleMInewMapping(MachineInstr *MI, unsigned int VirtReg, unsigned int PhysReg);
-    int allocateNewRegister(MachineInstr *MI);
+    std::vector<unsigned char> AssembleMInewMapping(MachineInstr *MI, unsigned int VirtReg, unsigned int PhysReg,
+						    unsigned int VirtReg2=0, unsigned int PhysReg2=0);
+    void getPhysRegs(MachineInstr *MI, unsigned int VirtReg, unsigned int PhysReg,
+		     unsigned int VirtReg2, unsigned int PhysReg2,
+		     std::vector<unsigned int> &PhysRegs);
+    bool getEncodingKey(MachineInstr *MI, const std::vector<unsigned int> &PhysRegs, EncodingKey &Key);
+    bool containsRetNewMapping(MachineInstr *MI, unsigned int VirtReg=0, unsigned int PhysReg=0,
+			       unsigned int VirtReg2=0, unsigned int PhysReg2=0);
+    void runOnWorklist(MachineFunction &MF);
+    void enqueue(MachineInstr *MI);
+    void enqueueUsesAndDefs(unsigned int VirtReg);
+    int allocateNewRegister(MachineInstr *MI, SmallVectorImpl<unsigned int> &ChangedVirtRegs);
+    bool allocateRegisterPair(MachineInstr *MI, SmallVectorImpl<unsigned int> &ChangedVirtRegs);
+    bool allocateWithEviction(MachineInstr *MI, SmallVectorImpl<unsigned int> &ChangedVirtRegs);
+    bool tryEvict(MachineInstr *MI, unsigned int VirtReg, unsigned int PhysReg,
+		  SmallVectorImpl<unsigned int> &ChangedVirtRegs);
+    unsigned int findSafeFreeReg(unsigned int VirtReg, unsigned int AvoidPhysReg);
+    void reassign(unsigned int VirtReg, unsigned int PhysReg);
+    bool isReallocatable(MachineInstr *MI, unsigned int VirtReg);
     unsigned int doCodeTransformation(MachineInstr *MI);
+    unsigned int doScratchTransformation(MachineInstr *MI);
+    bool saveSafeRegInXMM(MachineInstr *PushMI, MachineInstr *PopMI, unsigned int SuperRegSafe);
+    unsigned int assignFreeSafeReg(unsigned int VirtReg, ArrayRef<MachineInstr*> MIs);
+    void recomputeInterval(unsigned int VirtReg);
     unsigned int getSafeReg(MachineInstr *MI, unsigned int PrevPhysReg);
     unsigned int getSafeRegEXT(MachineInstr *MI, unsigned int PrevPhysReg);
     bool MIusesRegister(MachineInstr *MI, unsigned int safeRegister);
@@ -123,9 +244,10 @@ void GFreeModRMSIB::dumpAllocationOrder(AllocationOrder Order){
 
 // Another corner case is when we have two instructions, let's say A and B, and
 // A becomes evil when we realloc a register in B.
-// We fix this by doing two loops on the function. 
+// We fix this by putting back in the worklist every use and def of the
+// reallocated register (A included).
 
-// During the second loop, A will be evil and so a new register (hopefully)
+// When A is checked again, it will be evil and so a new register (hopefully)
 // will be allocated and the corresponding virtual register will be added to
 // the set of already allocated register. So, while processing B (or any other
 // instruction after A) that virtual register will not be reallocated.
@@ -133,7 +255,7 @@ void GFreeModRMSIB::dumpAllocationOrder(AllocationOrder Order){
 // When we do a code transformation, we do not change any mapping since it's
 // just a sort of wrapper around a MI.
 
-int GFreeModRMSIB::allocateNewRegister(MachineInstr *MI) {
+int GFreeModRMSIB::allocateNewRegister(MachineInstr *MI, SmallVectorImpl<unsigned int> &ChangedVirtRegs) {
   unsigned int VirtIndex;
   unsigned int VirtReg;
   unsigned int PrevPhysReg;
@@ -174,7 +296,7 @@ int GFreeModRMSIB::allocateNewRegister(MachineInstr *MI) {
 	}
 
 	// Try if with this register, the instruction still encode a ret.
-	if(containsRet(AssembleMInewMapping(MI, VirtReg, PhysReg))){ 
+	if(containsRetNewMapping(MI, VirtReg, PhysReg)){ 
 	  GFreeDEBUG(3, "  [-] " << TRI->getName(PhysReg) << " : still ret\n");
 	  stillcontainsList.front()++;
 	  continue;
@@ -183,14 +305,13 @@ int GFreeModRMSIB::allocateNewRegister(MachineInstr *MI) {
 	// If no interference, then we found a free register.	
 	if ((Matrix->checkInterference(VirtRegInterval, PhysReg) == LiveRegMatrix::IK_Free)){ 
 	  ++EvilSib;
-	  VRM->clearVirt(VirtReg);
-	  Matrix->assign(VirtRegInterval, PhysReg);
+	  reassign(VirtReg, PhysReg);
 	  
 	  GFreeDEBUG(1,"[MRM][+] found: " << TRI->getName(PhysReg) <<
 	               " from " << TRI->getName(PrevPhysReg) << " ("   <<
 		       MI->getOperand(VirtIndex)  <<  ") \n");
 	  VirtRegAlreadyReallocated.insert(VirtReg); 
-	  Matrix->invalidateVirtRegs();
+	  ChangedVirtRegs.push_back(VirtReg);
 	  return 1;
 	}
 	GFreeDEBUG(3,"  [-] " << TRI->getName(PhysReg) << " : interference\n");
@@ -211,33 +332,388 @@ int GFreeModRMSIB::allocateNewRegister(MachineInstr *MI) {
     return -1;
   }
 
+  // No free register makes MI safe by itself. Before the code
+  // transformation, try to move two registers at once or to make room for
+  // a safe register by evicting cheap live ranges.
+  if(!GFreeNoJointRealloc){
+    if(allocateRegisterPair(MI, ChangedVirtRegs) ||
+       allocateWithEviction(MI, ChangedVirtRegs)){
+      ++EvilSib;
+      return 1;
+    }
+  }
+
   // Otherwise, it means that at least one register didn't execeded the limit,
   // so we can do a code transformation.
-  else{
-    GFreeDEBUG(0,"[MRM][-] Do codetransform.\n");
-    return 0;
+  GFreeDEBUG(0,"[MRM][-] Do codetransform.\n");
+  return 0;
+}
+
+
+// Move VirtReg (and its live interval in the matrix) on PhysReg.
+void GFreeModRMSIB::reassign(unsigned int VirtReg, unsigned int PhysReg){
+  LiveInterval &VirtRegInterval = LIS->getInterval(VirtReg);
+  if(VRM->hasPhys(VirtReg))
+    Matrix->unassign(VirtRegInterval);
+  Matrix->assign(VirtRegInterval, PhysReg);
+  Matrix->invalidateVirtRegs();
+}
+
+bool GFreeModRMSIB::isReallocatable(MachineInstr *MI, unsigned int VirtReg){
+  return VirtRegAlreadyReallocated.count(VirtReg) == 0; // Read NOTE above.
+}
+
+// Joint search for the two-register instructions: it may happen that
+// neither register alone can be moved to a safe and free register, but a
+// pair of registers can (i.e. both registers are needed to change the
+// ModR/M). Both mappings must differ from the current ones, since the single
+// register moves were already tried by allocateNewRegister.
+bool GFreeModRMSIB::allocateRegisterPair(MachineInstr *MI, SmallVectorImpl<unsigned int> &ChangedVirtRegs){
+  SmallVector<unsigned int, 4> VirtRegs;
+  for(const MachineOperand &MO : MI->operands()){
+    if(MO.isReg() && TRI->isVirtualRegister(MO.getReg()) &&
+       isReallocatable(MI, MO.getReg()) &&
+       std::find(VirtRegs.begin(), VirtRegs.end(), MO.getReg()) == VirtRegs.end())
+      VirtRegs.push_back(MO.getReg());
+  }
+
+  for(unsigned int a = 0; a < VirtRegs.size(); a++){
+    for(unsigned int b = a + 1; b < VirtRegs.size(); b++){
+      unsigned int VirtRegA = VirtRegs[a], VirtRegB = VirtRegs[b];
+      unsigned int PrevPhysRegA = VRM->getPhys(VirtRegA);
+      unsigned int PrevPhysRegB = VRM->getPhys(VirtRegB);
+      LiveInterval &IntervalA = LIS->getInterval(VirtRegA);
+      LiveInterval &IntervalB = LIS->getInterval(VirtRegB);
+      AllocationOrder OrderA(VirtRegA, *VRM, RegClassInfo, Matrix);
+      AllocationOrder OrderB(VirtRegB, *VRM, RegClassInfo, Matrix);
+      unsigned int PhysRegA, PhysRegB;
+
+      while((PhysRegA = OrderA.next())){
+	if(PhysRegA == PrevPhysRegA)
+	  continue;
+	OrderB.rewind();
+	while((PhysRegB = OrderB.next())){
+	  if(PhysRegB == PrevPhysRegB)
+	    continue;
+	  if(containsRetNewMapping(MI, VirtRegA, PhysRegA, VirtRegB, PhysRegB))
+	    continue;
+
+	  // The encoding is safe, now check the interference. A and B may
+	  // interfere with each other, so take both out of the matrix first.
+	  Matrix->unassign(IntervalA);
+	  Matrix->unassign(IntervalB);
+	  if(Matrix->checkInterference(IntervalA, PhysRegA) == LiveRegMatrix::IK_Free){
+	    Matrix->assign(IntervalA, PhysRegA);
+	    if(Matrix->checkInterference(IntervalB, PhysRegB) == LiveRegMatrix::IK_Free){
+	      Matrix->assign(IntervalB, PhysRegB);
+	      Matrix->invalidateVirtRegs();
+	      GFreeDEBUG(1,"[MRM][+] found pair: " << TRI->getName(PhysRegA) << ", " <<
+			 TRI->getName(PhysRegB) << " from " << TRI->getName(PrevPhysRegA) <<
+			 ", " << TRI->getName(PrevPhysRegB) << "\n");
+	      ++JointPairRealloc;
+	      VirtRegAlreadyReallocated.insert(VirtRegA);
+	      VirtRegAlreadyReallocated.insert(VirtRegB);
+	      ChangedVirtRegs.push_back(VirtRegA);
+	      ChangedVirtRegs.push_back(VirtRegB);
+	      return true;
+	    }
+	    Matrix->unassign(IntervalA);
+	  }
+	  Matrix->assign(IntervalA, PrevPhysRegA);
+	  Matrix->assign(IntervalB, PrevPhysRegB);
+	}
+      }
+    }
+  }
+  Matrix->invalidateVirtRegs();
+  return false;
+}
+
+// Returns a physical register, different from AvoidPhysReg, that is free
+// for VirtReg (which must be unassigned) and such that none of its users
+// encodes a ret. Returns 0 if there isn't any.
+unsigned int GFreeModRMSIB::findSafeFreeReg(unsigned int VirtReg, unsigned int AvoidPhysReg){
+  LiveInterval &VirtRegInterval = LIS->getInterval(VirtReg);
+  AllocationOrder Order(VirtReg, *VRM, RegClassInfo, Matrix);
+  unsigned int PhysReg;
+
+  while((PhysReg = Order.next())){
+    if(PhysReg == AvoidPhysReg ||
+       Matrix->checkInterference(VirtRegInterval, PhysReg) != LiveRegMatrix::IK_Free)
+      continue;
+
+    bool Safe = true;
+    for(MachineInstr &UseMI : MRI->reg_nodbg_instructions(VirtReg)){
+      if(neverEncodesRetModRmSib(&UseMI))
+	continue;
+      // We can't tell anything if another register of UseMI is unassigned.
+      for(const MachineOperand &MO : UseMI.operands()){
+	if(MO.isReg() && TRI->isVirtualRegister(MO.getReg()) &&
+	   MO.getReg() != VirtReg && !VRM->hasPhys(MO.getReg()))
+	  Safe = false;
+      }
+      if(!Safe || containsRetNewMapping(&UseMI, VirtReg, PhysReg)){
+	Safe = false;
+	break;
+      }
+    }
+    if(Safe)
+      return PhysReg;
   }
+  return 0;
 }
 
+// Try to make PhysReg free for VirtReg by moving the (few and short) live
+// ranges that interfere with it, as RAGreedy does with its eviction chains.
+// Every evicted range must find another free register that doesn't make its
+// users evil, otherwise everything is rolled back.
+bool GFreeModRMSIB::tryEvict(MachineInstr *MI, unsigned int VirtReg, unsigned int PhysReg,
+			     SmallVectorImpl<unsigned int> &ChangedVirtRegs){
+  LiveInterval &VirtRegInterval = LIS->getInterval(VirtReg);
+  SmallVector<LiveInterval*, 4> Evictees;
+
+  for(MCRegUnitIterator Units(PhysReg, TRI); Units.isValid(); ++Units){
+    LiveIntervalUnion::Query &Q = Matrix->query(VirtRegInterval, *Units);
+    if(Q.collectInterferingVRegs(GFreeMaxEvictees + 1) > GFreeMaxEvictees)
+      return false;
+    for(LiveInterval *Intf : Q.interferingVRegs()){
+      if(std::find(Evictees.begin(), Evictees.end(), Intf) != Evictees.end())
+	continue;
+      // Don't touch the registers of MI, nor the already reallocated ones.
+      if(!isReallocatable(MI, Intf->reg) || MI->readsWritesVirtualRegister(Intf->reg).first ||
+	 MI->readsWritesVirtualRegister(Intf->reg).second)
+	return false;
+      if(Intf->getSize() > GFreeMaxEvictSize)
+	return false;
+      Evictees.push_back(Intf);
+      if(Evictees.size() > GFreeMaxEvictees)
+	return false;
+    }
+  }
+  if(Evictees.empty())
+    return false;
+
+  unsigned int PrevPhysReg = VRM->getPhys(VirtReg);
+  SmallVector<unsigned int, 4> PrevPhysRegs;
+  for(LiveInterval *Evictee : Evictees){
+    PrevPhysRegs.push_back(VRM->getPhys(Evictee->reg));
+    Matrix->unassign(*Evictee);
+  }
+
+  bool Done = Matrix->checkInterference(VirtRegInterval, PhysReg) == LiveRegMatrix::IK_Free;
+  if(Done){
+    reassign(VirtReg, PhysReg);
+    for(LiveInterval *Evictee : Evictees){
+      unsigned int NewPhysReg = findSafeFreeReg(Evictee->reg, PhysReg);
+      if(NewPhysReg == 0){
+	Done = false;
+	break;
+      }
+      Matrix->assign(*Evictee, NewPhysReg);
+    }
+  }
+
+  if(!Done){ // Roll back.
+    for(LiveInterval *Evictee : Evictees)
+      if(VRM->hasPhys(Evictee->reg))
+	Matrix->unassign(*Evictee);
+    if(VRM->getPhys(VirtReg) != PrevPhysReg)
+      reassign(VirtReg, PrevPhysReg);
+    for(unsigned int i = 0; i < Evictees.size(); i++)
+      Matrix->assign(*Evictees[i], PrevPhysRegs[i]);
+    Matrix->invalidateVirtRegs();
+    return false;
+  }
+
+  Matrix->invalidateVirtRegs();
+  GFreeDEBUG(1,"[MRM][+] found by eviction: " << TRI->getName(PhysReg) << " from " <<
+	     TRI->getName(PrevPhysReg) << " (" << Evictees.size() << " evicted)\n");
+  ++EvictionRealloc;
+  VirtRegAlreadyReallocated.insert(VirtReg);
+  ChangedVirtRegs.push_back(VirtReg);
+  for(LiveInterval *Evictee : Evictees){
+    VirtRegAlreadyReallocated.insert(Evictee->reg);
+    ChangedVirtRegs.push_back(Evictee->reg);
+  }
+  return true;
+}
+
+bool GFreeModRMSIB::allocateWithEviction(MachineInstr *MI, SmallVectorImpl<unsigned int> &ChangedVirtRegs){
+  for(const MachineOperand &MO : MI->operands()){
+    if(!MO.isReg() || !TRI->isVirtualRegister(MO.getReg()) || !isReallocatable(MI, MO.getReg()))
+      continue;
+    unsigned int VirtReg = MO.getReg();
+    unsigned int PrevPhysReg = VRM->getPhys(VirtReg);
+    LiveInterval &VirtRegInterval = LIS->getInterval(VirtReg);
+    AllocationOrder Order(VirtReg, *VRM, RegClassInfo, Matrix);
+    unsigned int PhysReg;
+
+    while((PhysReg = Order.next())){
+      if(PhysReg == PrevPhysReg || containsRetNewMapping(MI, VirtReg, PhysReg))
+	continue;
+      // Only virtual registers can be evicted.
+      if(Matrix->checkInterference(VirtRegInterval, PhysReg) != LiveRegMatrix::IK_VirtReg)
+	continue;
+      if(tryEvict(MI, VirtReg, PhysReg, ChangedVirtRegs))
+	return true;
+    }
+  }
+  return false;
+}
 
 std::vector<unsigned char> GFreeModRMSIB::AssembleMInewMapping(MachineInstr *MI, 
 							       unsigned int VirtReg, 
-							       unsigned int PhysReg){
-  assert(VRM->hasPhys(VirtReg) && "VRM doesn't have this mapping.");
-  unsigned int PrevPhysReg = VRM->getPhys(VirtReg);
+							       unsigned int PhysReg,
+							       unsigned int VirtReg2,
+							       unsigned int PhysReg2){
+  // VirtReg can be unassigned while we look for a new home for an evicted
+  // live range.
+  unsigned int PrevPhysReg = VRM->hasPhys(VirtReg) ? VRM->getPhys(VirtReg) : 0;
+  unsigned int PrevPhysReg2 = (VirtReg2 && VRM->hasPhys(VirtReg2)) ? VRM->getPhys(VirtReg2) : 0;
 
   // Temporary create the new virt<->phys mapping
-  VRM->clearVirt(VirtReg);
+  if(PrevPhysReg)
+    VRM->clearVirt(VirtReg);
   VRM->assignVirt2Phys(VirtReg, PhysReg);
+  if(VirtReg2){
+    if(PrevPhysReg2)
+      VRM->clearVirt(VirtReg2);
+    VRM->assignVirt2Phys(VirtReg2, PhysReg2);
+  }
 
   std::vector<unsigned char> MIBytes = Assembler->MachineInstrToBytes(MI);
 
   // Restore the old mapping.
   VRM->clearVirt(VirtReg);
-  VRM->assignVirt2Phys(VirtReg, PrevPhysReg);
+  if(PrevPhysReg)
+    VRM->assignVirt2Phys(VirtReg, PrevPhysReg);
+  if(VirtReg2){
+    VRM->clearVirt(VirtReg2);
+    if(PrevPhysReg2)
+      VRM->assignVirt2Phys(VirtReg2, PrevPhysReg2);
+  }
   return MIBytes;
 }
 
+// Returns, for each operand of MI, the physical register it is rewritten to
+// if VirtReg is mapped on PhysReg and VirtReg2 on PhysReg2 (0 for non register
+// operands).
+void GFreeModRMSIB::getPhysRegs(MachineInstr *MI, unsigned int VirtReg,
+				unsigned int PhysReg, unsigned int VirtReg2,
+				unsigned int PhysReg2, std::vector<unsigned int> &PhysRegs){
+  PhysRegs.assign(MI->getNumOperands(), 0);
+  for(unsigned int i = 0; i < MI->getNumOperands(); i++){
+    const MachineOperand &MO = MI->getOperand(i);
+    if(!MO.isReg())
+      continue;
+    unsigned int Reg = MO.getReg();
+    if(TRI->isVirtualRegister(Reg)){
+      if(Reg == VirtReg)
+	Reg = PhysReg;
+      else if(Reg == VirtReg2)
+	Reg = PhysReg2;
+      else
+	Reg = VRM->getPhys(Reg);
+      if(MO.getSubReg())
+	Reg = TRI->getSubReg(Reg, MO.getSubReg());
+    }
+    PhysRegs[i] = Reg;
+  }
+}
+
+// Builds the cache key of MI from the rewritten registers. Returns false if
+// MI has an operand we can't describe in the key.
+bool GFreeModRMSIB::getEncodingKey(MachineInstr *MI, const std::vector<unsigned int> &PhysRegs,
+				   EncodingKey &Key){
+  Key.clear();
+  Key.push_back(MI->getOpcode());
+  for(unsigned int i = 0; i < MI->getNumOperands(); i++){
+    const MachineOperand &MO = MI->getOperand(i);
+    if(MO.isReg()){
+      if(MO.isImplicit())
+	continue;
+      Key.push_back(MachineOperand::MO_Register);
+      Key.push_back(PhysRegs[i] | (MO.isDef() << 30) | ((int64_t)MO.isDead() << 31));
+    }
+    else if(MO.isImm()){
+      Key.push_back(MachineOperand::MO_Immediate);
+      Key.push_back(MO.getImm());
+    }
+    else{
+      return false;
+    }
+  }
+  return true;
+}
+
+// Returns true if MI, with VirtReg mapped on PhysReg and VirtReg2 on PhysReg2
+// (or with the current mapping if VirtReg is 0), encodes a ret. The verdict is memoized, so the
+// same probe in the next loops (or functions) is just a lookup. On a miss we
+// first ask the predictor and assemble MI only if it can't handle the form.
+bool GFreeModRMSIB::containsRetNewMapping(MachineInstr *MI, unsigned int VirtReg,
+					  unsigned int PhysReg, unsigned int VirtReg2,
+					  unsigned int PhysReg2){
+  std::vector<unsigned int> PhysRegs;
+  getPhysRegs(MI, VirtReg, PhysReg, VirtReg2, PhysReg2, PhysRegs);
+
+  EncodingKey Key;
+  bool Cacheable = !GFreeNoEncodingCache && getEncodingKey(MI, PhysRegs, Key);
+  if(Cacheable){
+    auto It = EncodingCache.find(Key);
+    if(It != EncodingCache.end()){
+      ++EncodingCacheHit;
+      return It->second;
+    }
+  }
+  ++EncodingCacheMiss;
+
+  int Predicted = GFreeNoPredictor ? -1 : Predictor->predictContainsRet(MI, PhysRegs);
+  signed char &Trusted = PredictorTrusted[MI->getOpcode()];
+  if(Predicted != -1 && Trusted == 0)
+    Predicted = -1;
+  bool Evil;
+  if(Predicted != -1 && Trusted == 1 && !GFreeVerifyPredictor){
+    ++PredictorHit;
+    Evil = Predicted;
+  }
+  else{
+    if(Predicted == -1)
+      ++PredictorFallback;
+    std::vector<unsigned char> Bytes;
+    if(VirtReg == 0)
+      Bytes = Assembler->MachineInstrToBytes(MI);
+    else
+      Bytes = AssembleMInewMapping(MI, VirtReg, PhysReg, VirtReg2, PhysReg2);
+    Evil = containsRet(Bytes);
+
+    // First prediction for this opcode: compare the whole encoding, the
+    // prefixes (that the predictor doesn't compute) apart.
+    if(Predicted != -1 && Trusted == -1){
+      GFreePredictedEncoding Enc;
+      bool Same = Predicted == Evil;
+      if(Predictor->predictEncoding(MI, PhysRegs, Enc))
+	Same = Enc.Bytes.size() <= Bytes.size() &&
+	  std::equal(Enc.Bytes.begin(), Enc.Bytes.end(), Bytes.end() - Enc.Bytes.size());
+      Trusted = Same;
+      if(!Same){
+	++PredictorUntrusted;
+	GFreeDEBUG(1, "[MRM][!] Predictor disabled for the opcode of: " << *MI);
+      }
+    }
+
+    if(Predicted != -1 && Predicted != Evil){
+      ++PredictorMismatch;
+      if(GFreeVerifyPredictor)
+	errs() << "[MRM][!] Predictor says " << (Predicted ? "evil" : "safe")
+	       << " but the assembler says " << (Evil ? "evil" : "safe") << ": " << *MI;
+    }
+  }
+
+  if(Cacheable)
+    EncodingCache[Key] = Evil;
+  return Evil;
+}
+
 bool GFreeModRMSIB::MIusesRegister(MachineInstr *MI, unsigned int safeRegister){
   unsigned int PhysReg;
   for(const MachineOperand &MO : MI->operands()){
@@ -247,12 +723,8 @@ bool GFreeModRMSIB::MIusesRegister(MachineInstr *MI, unsigned int safeRegister){
     // If necessary, translate virtual register.
     PhysReg = TRI->isVirtualRegister(MO.getReg()) ? VRM->getPhys(MO.getReg()) : MO.getReg();
 
-    if(PhysReg == llvm::getX86SubSuperRegister(safeRegister, 64, false) ||
-       PhysReg == llvm::getX86SubSuperRegister(safeRegister, 32, false) ||
-       PhysReg == llvm::getX86SubSuperRegister(safeRegister, 16, false) ||
-       PhysReg == llvm::getX86SubSuperRegister(safeRegister, 8,  true ) ||
-       PhysReg == llvm::getX86SubSuperRegister(safeRegister, 8,  false) )
-
+    // Any sub or super register (R13D, XMM13 of YMM13...).
+    if(PhysReg && TRI->regsOverlap(PhysReg, safeRegister))
       return true;
   }
 
@@ -273,12 +745,35 @@ bool GFreeModRMSIB::MIusesRegister(MachineInstr *MI, unsigned int safeRegister){
 
 unsigned int GFreeModRMSIB::getSafeReg(MachineInstr *MI, unsigned int PrevVirtReg){
   MachineFunction *MF = MI->getParent()->getParent();
-  unsigned int safeRegisters[3] =  {X86::R13, X86::R15, X86::R14};
-  int i;
+  static const unsigned int gprSafeRegisters[3] =  {X86::R13, X86::R15, X86::R14};
+  // The ABCD classes are needed for the high 8 bit subregisters (AH, BH..),
+  // which R13-R15 don't have.
+  static const unsigned int abcdSafeRegisters[4] =  {X86::RBX, X86::RCX, X86::RDX, X86::RAX};
+  const TargetRegisterClass *VirtRegRC = MF->getRegInfo().getRegClass(PrevVirtReg);
+  // Same for the vector registers, whose low 3 bits go in the ModRM/SIB
+  // fields like the GPRs: xmm13-15 put 101-111 there.
+  static const unsigned int xmmSafeRegisters[3] = {X86::XMM13, X86::XMM15, X86::XMM14};
+  static const unsigned int ymmSafeRegisters[3] = {X86::YMM13, X86::YMM15, X86::YMM14};
+  if(X86::VR256RegClass.hasSubClassEq(VirtRegRC) || X86::VR128RegClass.hasSubClassEq(VirtRegRC) ||
+     X86::FR32RegClass.hasSubClassEq(VirtRegRC) || X86::FR64RegClass.hasSubClassEq(VirtRegRC)){
+    bool isYMM = X86::VR256RegClass.hasSubClassEq(VirtRegRC);
+    for(unsigned int i=0; i<3; i++){
+      unsigned int SafeReg = isYMM ? ymmSafeRegisters[i] : xmmSafeRegisters[i];
+      if(! MIusesRegister(MI, SafeReg) )
+	return SafeReg;
+    }
+    return 0;
+  }
+  bool isABCD = VirtRegRC == &X86::GR16_ABCDRegClass ||
+                VirtRegRC == &X86::GR32_ABCDRegClass ||
+                VirtRegRC == &X86::GR64_ABCDRegClass;
+  const unsigned int *safeRegisters = isABCD ? abcdSafeRegisters : gprSafeRegisters;
+  unsigned int numSafeRegisters = isABCD ? 4 : 3;
+  unsigned int i;
 
   // If MI *doesn't* use safeRegister[i] (or any of his subregisters),
   // then we can use it.
-  for(i=0; i<3; i++){
+  for(i=0; i<numSafeRegisters; i++){
     if(! MIusesRegister(MI, safeRegisters[i]) )
       break;
   }
@@ -286,13 +781,15 @@ unsigned int GFreeModRMSIB::getSafeReg(MachineInstr *MI, unsigned int PrevVirtRe
   // This should never happen because an instruction can use up to 3
   // register, but if we are here one of those 3 register must be different for
   // one contained in usableRegisters, otherwise the MI wasn't evil.
-  assert(i!=3 && "Can't find a safe reg in X86GFreeModRMSIB.cpp!");
+  // (An ABCD instruction may use all of them, the caller handles it).
+  if(i == numSafeRegisters){
+    assert(isABCD && "Can't find a safe reg in X86GFreeModRMSIB.cpp!");
+    return 0;
+  }
 
-  
   // We return the right size of the safe reg (es: R13d, R13w)
-  const TargetRegisterClass *VirtRegRC = MF->getRegInfo().getRegClass(PrevVirtReg);
-  // TODO: support X86::GR32_ABCDRegClass
-  if(VirtRegRC == &X86::GR32_ABCDRegClass) return 0;
+  if(isABCD)
+    return llvm::getX86SubSuperRegister(safeRegisters[i], VirtRegRC->getSize() * 8, false);
   const TargetRegisterClass *LargestVirtRegRC = TRI->getLargestLegalSuperClass(VirtRegRC,*MF); // GR64_with_sub_8bit -> GR64
   // errs() << "MI: " << *MI;
   // errs() << "Name: " << TRI->getRegClassName(VirtRegRC) << "\n";
@@ -312,7 +809,7 @@ unsigned int GFreeModRMSIB::getSafeReg(MachineInstr *MI, unsigned int PrevVirtRe
   return 0;
 }
 
-unsigned int getMOVrrOpcode(unsigned int PrevPhysReg){
+unsigned int getMOVrrOpcode(unsigned int PrevPhysReg, const X86Subtarget &STI){
   if( X86::GR8RegClass.contains(PrevPhysReg)){
     return X86::MOV8rr;
   }
@@ -325,14 +822,203 @@ unsigned int getMOVrrOpcode(unsigned int PrevPhysReg){
   else if (X86::GR64RegClass.contains(PrevPhysReg)){
     return X86::MOV64rr;
   }
+  // FR32 and FR64 live in the same XMM registers.
+  else if (X86::VR128RegClass.contains(PrevPhysReg)){
+    return STI.hasAVX() ? X86::VMOVAPSrr : X86::MOVAPSrr;
+  }
+  else if (X86::VR256RegClass.contains(PrevPhysReg)){
+    return X86::VMOVAPSYrr;
+  }
   else {
     return 0;
   }
 }
 
-// Returns true if a code transformation is done, false otherwise.
+// Throw away the live interval of VirtReg and compute it again from its
+// uses and defs. The new interval must be a subset of the old one, so it
+// always fits on the same physical register.
+void GFreeModRMSIB::recomputeInterval(unsigned int VirtReg){
+  unsigned int PhysReg = VRM->getPhys(VirtReg);
+  Matrix->unassign(LIS->getInterval(VirtReg));
+  LIS->removeInterval(VirtReg);
+  Matrix->assign(LIS->createAndComputeVirtRegInterval(VirtReg), PhysReg);
+  Matrix->invalidateVirtRegs();
+}
+
+// Assign the (short) live range of the new VirtReg to a free physical
+// register such that none of MIs encodes a ret. Returns it, 0 otherwise.
+unsigned int GFreeModRMSIB::assignFreeSafeReg(unsigned int VirtReg, ArrayRef<MachineInstr*> MIs){
+  LiveInterval &VirtRegInterval = LIS->getInterval(VirtReg);
+  AllocationOrder Order(VirtReg, *VRM, RegClassInfo, Matrix);
+  unsigned int PhysReg;
+
+  while((PhysReg = Order.next())){
+    if(Matrix->checkInterference(VirtRegInterval, PhysReg) != LiveRegMatrix::IK_Free)
+      continue;
+    bool Safe = true;
+    for(MachineInstr *MI : MIs){
+      if(containsRetNewMapping(MI, VirtReg, PhysReg)){
+	Safe = false;
+	break;
+      }
+    }
+    if(!Safe)
+      continue;
+    Matrix->assign(VirtRegInterval, PhysReg);
+    VirtRegAlreadyReallocated.insert(VirtReg);
+    return PhysReg;
+  }
+  return 0;
+}
+
+// Before falling back to push/pop, look for a register that is dead across
+// MI. Instead of a physical register we use a new virtual register, live
+// only from the copy before MI to the copy after MI:
+// ScratchReg = COPY VirtReg
+// INST with ScratchReg
+// VirtReg = COPY ScratchReg
+// The matrix tells us if a physical register is free on this tiny range (so
+// no save/restore is needed), and the rewriter does the rest.
+// The copies are dropped when MI doesn't read (or write) VirtReg.
+// Returns VirtReg if the transformation is done, 0 otherwise.
+unsigned int GFreeModRMSIB::doScratchTransformation(MachineInstr *MI) {
+  MachineBasicBlock *MBB =  MI->getParent();
+  const TargetInstrInfo &TII = *MBB->getParent()->getSubtarget().getInstrInfo();
+  DebugLoc DL = MI->getDebugLoc();
+  SmallVector<unsigned int, 4> VirtRegs;
+
+  for(const MachineOperand &MO : MI->operands()){
+    if(MO.isReg() && TRI->isVirtualRegister(MO.getReg()) &&
+       std::find(VirtRegs.begin(), VirtRegs.end(), MO.getReg()) == VirtRegs.end())
+      VirtRegs.push_back(MO.getReg());
+  }
+
+  for(unsigned int VirtReg : VirtRegs){
+    const TargetRegisterClass *RC = MRI->getRegClass(VirtReg);
+    // Don't create anything if no register of the class makes MI safe.
+    bool HasSafeReg = false;
+    for(MCPhysReg PhysReg : RegClassInfo.getOrder(RC)){
+      if(!containsRetNewMapping(MI, VirtReg, PhysReg)){
+	HasSafeReg = true;
+	break;
+      }
+    }
+    if(!HasSafeReg)
+      continue;
+
+    bool Reads = false, Writes = false;
+    for(const MachineOperand &MO : MI->operands()){
+      if(!MO.isReg() || MO.getReg() != VirtReg)
+	continue;
+      Reads |= MO.readsReg();
+      Writes |= MO.isDef() && !MO.isDead();
+    }
+
+    unsigned int ScratchReg = MRI->createVirtualRegister(RC);
+    VRM->grow();
+    MachineInstr *CopyIn = nullptr, *CopyOut = nullptr;
+    if(Reads){
+      CopyIn = BuildMI(*MBB, MI, DL, TII.get(TargetOpcode::COPY), ScratchReg)
+	.addReg(VirtReg);
+      LIS->InsertMachineInstrInMaps(CopyIn);
+    }
+    for(MachineOperand &MO : MI->operands()){
+      if(MO.isReg() && MO.getReg() == VirtReg){
+	MO.setReg(ScratchReg);
+	MO.setIsKill(false);
+      }
+    }
+    if(Writes){
+      CopyOut = BuildMI(*MBB, std::next(MachineBasicBlock::iterator(MI)), DL,
+			TII.get(TargetOpcode::COPY), VirtReg)
+	.addReg(ScratchReg);
+      LIS->InsertMachineInstrInMaps(CopyOut);
+    }
+    recomputeInterval(VirtReg);
+    LIS->createAndComputeVirtRegInterval(ScratchReg);
+
+    SmallVector<MachineInstr*, 3> MustBeSafe;
+    MustBeSafe.push_back(MI);
+    if(CopyIn) MustBeSafe.push_back(CopyIn);
+    if(CopyOut) MustBeSafe.push_back(CopyOut);
+    if(unsigned int PhysReg = assignFreeSafeReg(ScratchReg, MustBeSafe)){
+      ++EvilSib; // Update stats.
+      ++ScratchVirtRegs;
+      GFreeDEBUG(1, "[MRM][+] " << PrintReg(VirtReg) << " moved in the free register "
+		 << TRI->getName(PhysReg) << " across: " << *MI);
+      return VirtReg;
+    }
+
+    // No free register, undo.
+    for(MachineOperand &MO : MI->operands()){
+      if(MO.isReg() && MO.getReg() == ScratchReg)
+	MO.setReg(VirtReg);
+    }
+    for(MachineInstr *Copy : {CopyIn, CopyOut}){
+      if(!Copy)
+	continue;
+      LIS->RemoveMachineInstrFromMaps(Copy);
+      Copy->eraseFromParent();
+    }
+    LIS->removeInterval(ScratchReg);
+    recomputeInterval(VirtReg);
+  }
+  return 0;
+}
+
+// The push/pop around the evil instruction cost two memory accesses. If a
+// XMM register is free across them, park the safe register there instead:
+// MOVQ XMM, R13 ... MOVQ R13, XMM.
+bool GFreeModRMSIB::saveSafeRegInXMM(MachineInstr *PushMI, MachineInstr *PopMI, unsigned int SuperRegSafe){
+  MachineBasicBlock *MBB =  PushMI->getParent();
+  MachineFunction *MF = MBB->getParent();
+  const X86Subtarget &STI = MF->getSubtarget<X86Subtarget>();
+  const X86InstrInfo &TII = *STI.getInstrInfo();
+  DebugLoc DL = PushMI->getDebugLoc();
+
+  // Kernels and the like don't want us to touch the vector registers.
+  if(GFreeNoXMMSpill || !STI.hasSSE2() || STI.useSoftFloat() ||
+     MF->getFunction()->hasFnAttribute(Attribute::NoImplicitFloat))
+    return false;
+
+  unsigned int XMMReg = MRI->createVirtualRegister(&X86::VR128RegClass);
+  VRM->grow();
+  MachineInstr *SaveMI = BuildMI(*MBB, PushMI, DL,
+				 TII.get(STI.hasAVX() ? X86::VMOV64toPQIrr : X86::MOV64toPQIrr), XMMReg)
+    .addReg(SuperRegSafe, RegState::Undef);
+  MachineInstr *RestoreMI = BuildMI(*MBB, PopMI, DL,
+				    TII.get(STI.hasAVX() ? X86::VMOVPQIto64rr : X86::MOVPQIto64rr), SuperRegSafe)
+    .addReg(XMMReg, RegState::Kill);
+  LIS->InsertMachineInstrInMaps(SaveMI);
+  LIS->InsertMachineInstrInMaps(RestoreMI);
+  LIS->createAndComputeVirtRegInterval(XMMReg);
+
+  MachineInstr *Moves[2] = {SaveMI, RestoreMI};
+  bool Saved = assignFreeSafeReg(XMMReg, Moves) != 0;
+  if(!Saved)
+    LIS->removeInterval(XMMReg);
+  else
+    ++XMMSpills;
+
+  // Drop the stack (or the XMM) version.
+  MachineInstr *DeadMIs[2] = {Saved ? PushMI : SaveMI, Saved ? PopMI : RestoreMI};
+  for(MachineInstr *DeadMI : DeadMIs){
+    LIS->RemoveMachineInstrFromMaps(DeadMI);
+    DeadMI->eraseFromParent();
+  }
+  return Saved;
+}
+
+// Returns the virtual register that was moved into the safe register if a
+// code transformation is done, 0 otherwise.
 unsigned int GFreeModRMSIB::doCodeTransformation(MachineInstr *MI) {
 
+  // A register dead across MI is always better than push/pop.
+  if(!GFreeNoScratchReg){
+    if(unsigned int VirtReg = doScratchTransformation(MI))
+      return VirtReg;
+  }
+
   MachineBasicBlock *MBB =  MI->getParent();
   MachineFunction *MF = MBB->getParent();
   const X86Subtarget &STI = MF->getSubtarget<X86Subtarget>();
@@ -359,12 +1045,12 @@ unsigned int GFreeModRMSIB::doCodeTransformation(MachineInstr *MI) {
         VirtReg = MI->getOperand(VirtIndex).getReg();
 	PrevPhysReg = VRM->getPhys(VirtReg);
 	NewReg = getSafeReg(MI, VirtReg);
-	MovOpcode = getMOVrrOpcode(PrevPhysReg);
+	MovOpcode = getMOVrrOpcode(PrevPhysReg, STI);
 	if(NewReg == 0 || MovOpcode == 0){
 	  errs() << "[TODO] MI not handled (1): " << *MI;
 	  return 0;
 	}
-	if(!containsRet(AssembleMInewMapping(MI, VirtReg, NewReg)))
+	if(!containsRetNewMapping(MI, VirtReg, NewReg))
 	  break;
     }
   }
@@ -376,14 +1062,24 @@ unsigned int GFreeModRMSIB::doCodeTransformation(MachineInstr *MI) {
   }
   // Otherwise do the code transformation.
   ++EvilSib; // Update stats.
-  unsigned int SuperRegSafe = llvm::getX86SubSuperRegister(NewReg, 64,  false);
+  // A VEX encoded move zeroes the upper half of the YMM register, so
+  // with AVX the whole YMM is saved.
+  bool isVector = X86::VR128RegClass.contains(NewReg) || X86::VR256RegClass.contains(NewReg);
+  unsigned int SuperRegSafe;
+  if(!isVector)
+    SuperRegSafe = llvm::getX86SubSuperRegister(NewReg, 64,  false);
+  else if(STI.hasAVX() && X86::VR128RegClass.contains(NewReg))
+    SuperRegSafe = TRI->getMatchingSuperReg(NewReg, X86::sub_xmm, &X86::VR256RegClass);
+  else
+    SuperRegSafe = NewReg;
   MBB->addLiveIn(SuperRegSafe);
   MBB->sortUniqueLiveIns();
 
   
-  // PUSH R13;
-  pushReg(MI, SuperRegSafe, RegState::Undef); 
-  InsertedBefore++;
+  // PUSH R13; (or lea rsp,[rsp-16]; movups [rsp],xmm13)
+  MachineInstr *PushMI = isVector ? pushVectorReg(MI, SuperRegSafe, RegState::Undef) :
+    pushReg(MI, SuperRegSafe, RegState::Undef);
+  InsertedBefore += isVector ? 2 : 1;
   // If this is a copy and we are targeting the first register, we can skip this mov
   if(! ((MI->getOpcode() == TargetOpcode::COPY) &&
 	(VirtIndex == 0)) )
@@ -421,6 +1117,7 @@ unsigned int GFreeModRMSIB::doCodeTransformation(MachineInstr *MI) {
        VRM->getPhys(VirtReg) == VRM->getPhys(MO.getReg())){
       MIB = BuildMI(*MBB, MI, DL, TII.get(TargetOpcode::IMPLICIT_DEF), MO.getReg());
       MO.setReg(NewReg);
+      InsertedBefore++;
     }
   }
 
@@ -442,9 +1139,9 @@ unsigned int GFreeModRMSIB::doCodeTransformation(MachineInstr *MI) {
     }
 
 
-  // POP R13;
-  MachineInstrBuilder PopMIB = popReg(MI, SuperRegSafe); 
-  InsertedAfter++;
+  // POP R13; (or movups xmm13,[rsp]; lea rsp,[rsp+16])
+  MachineInstrBuilder PopMIB = isVector ? popVectorReg(MI, SuperRegSafe) : popReg(MI, SuperRegSafe);
+  InsertedAfter += isVector ? 2 : 1;
   
   // Move MI in the middle, before the last mov (MovMIB) if it was
   // created, otherwise before the pop (PopMIB)
@@ -458,53 +1155,134 @@ unsigned int GFreeModRMSIB::doCodeTransformation(MachineInstr *MI) {
   LIS->InsertMachineInstrRangeInMaps(std::prev(MBBI,InsertedBefore), std::next(MBBI,InsertedAfter+1));
   LIS->repairIntervalsInRange(MBB, MBBI, MBBI, Arr);
 
-  return 1;
+  // Use a free XMM register instead of the stack, if any.
+  if(isVector)
+    ++VectorSafeRegs;
+  else
+    saveSafeRegInXMM(PushMI, PopMIB, SuperRegSafe);
+
+  return VirtReg;
 }
 
 
-bool GFreeModRMSIB::runOnMachineBasicBlock(MachineBasicBlock &MBB) {
-  MachineFunction *MF = MBB.getParent();
-  VRM = &getAnalysis<VirtRegMap>();
-  Matrix = &getAnalysis<LiveRegMatrix>();
-  LIS = &getAnalysis<LiveIntervals>();
-  TRI = MF->getSubtarget().getRegisterInfo();
-  RegClassInfo.runOnMachineFunction(VRM->getMachineFunction());
-  MachineBasicBlock::iterator MBBI, MBBIE;
-  MachineInstr *MI;
-  Assembler = new GFreeAssembler(*MF, VRM);
-
-  bool loop_again = false;
-  // VirtRegAlreadyReallocated.clear();
-  for (MBBI = MBB.begin(), MBBIE = MBB.end(); MBBI != MBBIE; MBBI++) {
-    
-    MI = MBBI;
+void GFreeModRMSIB::enqueue(MachineInstr *MI){
+  if(InWorklist.insert(MI).second)
+    Worklist.push_back(MI);
+}
+
+// Only the instructions that reference VirtReg can change their encoding
+// after VirtReg is reassigned (or moved into a safe register).
+void GFreeModRMSIB::enqueueUsesAndDefs(unsigned int VirtReg){
+  for(MachineInstr &UseMI : MRI->reg_instructions(VirtReg))
+    enqueue(&UseMI);
+}
+
+// Every instruction is checked once (by the prescan, when enabled). When a virtual register is reassigned,
+// only its uses and defs are checked again, so the pass is linear in the size
+// of the function plus the number of reallocations. A virtual register is
+// never reallocated twice (see VirtRegAlreadyReallocated), and an
+// instruction visited more than -gfree-modrm-max-visits times only gets code
+// transformations. The time budget does the same for the whole function.
+void GFreeModRMSIB::runOnWorklist(MachineFunction &MF){
+  auto Start = std::chrono::steady_clock::now();
+  unsigned int NumInstrs = 0;
+  unsigned int Visits = 0;
+  DenseMap<const MachineInstr *, unsigned int> InstrVisits;
+  bool OverBudget = false;
+
+  Worklist.clear();
+  InWorklist.clear();
+
+  // Encode the whole function at once, and start only from the instructions
+  // that are evil right now. The others are checked again only if one of
+  // their registers is changed.
+  GFreeEncodedBytes Prescan;
+  if(!GFreeNoPrescan){
+    Assembler->encodeFunction(MF, Prescan, [this](const MachineInstr &MI){
+	return GFreeNoPredictor || !Predictor->neverEncodesRet(MI.getOpcode());
+      });
+  }
+
+  for(MachineBasicBlock &MBB : MF){
+    if(&MBB == Assembler->tmpMBB)
+      continue;
+    for(MachineInstr &MI : MBB){
+      NumInstrs++;
+      if(!GFreeNoPrescan){
+	if(!Prescan.isEncoded(&MI))
+	  continue;
+	bool Evil = containsRet(Prescan.getBytes(&MI));
+	// Save the verdict, the worklist would ask it again.
+	std::vector<unsigned int> PhysRegs;
+	EncodingKey Key;
+	getPhysRegs(&MI, 0, 0, 0, 0, PhysRegs);
+	if(!GFreeNoEncodingCache && getEncodingKey(&MI, PhysRegs, Key))
+	  EncodingCache[Key] = Evil;
+	if(!Evil)
+	  continue;
+	++PrescanEvil;
+      }
+      enqueue(&MI);
+    }
+  }
+
+  if(!GFreeNoPrescan && Worklist.empty()){
+    ++PrescanSkipped;
+    GFreeDEBUG(2, "[MRM][-] Nothing to do on " << MF.getName() << "\n");
+    return;
+  }
+
+  while(!Worklist.empty()){
+    MachineInstr *MI = Worklist.front();
+    Worklist.pop_front();
+    InWorklist.erase(MI);
+    ++WorklistVisits;
+    Visits++;
+    unsigned int MIVisits = ++InstrVisits[MI];
+
     if( neverEncodesRetModRmSib(MI) ) 
       continue;
-    // 1. 2. 3. 4.
-    std::vector<unsigned char> MIbytes = Assembler->MachineInstrToBytes(MI);
-    
-    // 5. Check if there's a ret.
-    if( containsRet(MIbytes) ){
-      GFreeDEBUG(1, "[MRM][+] Contains Ret: " << *MI); 
-      
-      int result = allocateNewRegister(MI);
+    if( !GFreeNoPredictor && Predictor->neverEncodesRet(MI->getOpcode()) ){
+      ++PredictorPruned;
+      continue;
+    }
+    // 1. 2. 3. 4. 5. Assemble (or look up) and check if there's a ret.
+    if( !containsRetNewMapping(MI) )
+      continue;
+    GFreeDEBUG(1, "[MRM][+] Contains Ret: " << *MI); 
 
-      if (result == 1){  // We did something (a new register was found).
-	loop_again = true;
-	continue;
-      }
-      if( result == -1 ){ // We can't do nothing.
-	continue;
-      }
-      if( result ==  0 ){ // We can do something.
-	loop_again |= doCodeTransformation(MI);
+    if(!OverBudget && GFreeModRMTimeBudget){
+      auto Elapsed = std::chrono::duration_cast<std::chrono::milliseconds>(
+			      std::chrono::steady_clock::now() - Start);
+      OverBudget = Elapsed.count() > GFreeModRMTimeBudget;
+      if(OverBudget){
+	++BudgetExceeded;
+	GFreeDEBUG(0, "[MRM][-] Budget exceeded on " << MF.getName() << ", only code transformations from now on.\n");
       }
     }
-  } // end while 
 
-  delete Assembler;	
-  // errs()<< "After MODRM/SIB: " << MBB;
-  return loop_again;
+    bool Capped = MIVisits > GFreeModRMMaxVisits;
+    if(Capped && MIVisits == GFreeModRMMaxVisits + 1){
+      ++VisitsCapped;
+      GFreeDEBUG(1, "[MRM][-] Visit cap reached, only code transformations for: " << *MI);
+    }
+
+    SmallVector<unsigned int, 4> ChangedVirtRegs;
+    int result = (OverBudget || Capped) ? 0 : allocateNewRegister(MI, ChangedVirtRegs);
+
+    if( result == -1 ) // We can't do nothing.
+      continue;
+    if( result == 0 ){ // We can do something.
+      if(unsigned int ChangedVirtReg = doCodeTransformation(MI))
+	ChangedVirtRegs.push_back(ChangedVirtReg);
+    }
+
+    for(unsigned int ChangedVirtReg : ChangedVirtRegs)
+      enqueueUsesAndDefs(ChangedVirtReg);
+  }
+
+  GFreeDEBUG(2, "[MRM][-] On " << MF.getName() << " we did " << Visits << " visits for "
+	     << NumInstrs << " instructions\n");
 }
 
 static RegisterPass<GFreeModRMSIB> X("gfreemodrmsib", "GFreeModRMSIB");
@@ -0,0 +1,123 @@
+//===-- X86GFreeRegAllocHints.cpp - Evil-byte-aware allocation order ------===//
+//
+//                     The LLVM Compiler Infrastructure
+//
+//===----------------------------------------------------------------------===//
+//
+// This file implements X86RegisterInfo::getRegAllocationHints. The allocation
+// order of a virtual register is reordered so that the physical registers
+// that would make one of its users encode a ret in the ModR/M or SIB byte
+// are tried last. This way RAGreedy avoids most of the bad assignments up
+// front and GFreeModRMSIB is left as a (rare) fixup.
+//
+//===----------------------------------------------------------------------===//
+
+#include "X86RegisterInfo.h"
+#include "X86GFreeModRMPredictor.h"
+#include "X86GFreeUtils.h"
+#include "llvm/ADT/Statistic.h"
+#include "llvm/CodeGen/MachineFunction.h"
+#include "llvm/CodeGen/MachineRegisterInfo.h"
+#include "llvm/CodeGen/VirtRegMap.h"
+#include "llvm/Target/TargetSubtargetInfo.h"
+
+using namespace llvm;
+
+#define DEBUG_TYPE "gfreeallochints"
+STATISTIC(HintedVirtRegs, "Number of virtual registers with an evil-byte-aware allocation order");
+
+static cl::opt<bool> GFreeNoAllocHints("gfree-no-alloc-hints", cl::Hidden,
+	       cl::desc("Don't reorder the allocation order to avoid evil ModRM/SIB"));
+
+static cl::opt<unsigned> GFreeAllocHintsMaxUses("gfree-alloc-hints-max-uses", cl::Hidden, cl::init(32),
+	       cl::desc("Max number of users of a virtual register inspected to build its hints"));
+
+// Out of line: GFreeModRMPredictor is incomplete in X86RegisterInfo.h.
+X86RegisterInfo::~X86RegisterInfo() {}
+
+// One predictor per subtarget, owned by its register info: it only caches
+// per-opcode information and dies with the subtarget.
+GFreeModRMPredictor &X86RegisterInfo::getGFreeModRMPredictor(const TargetInstrInfo *TII) const {
+  if(!GFreePredictor)
+    GFreePredictor.reset(new GFreeModRMPredictor(TII, this));
+  return *GFreePredictor;
+}
+
+void X86RegisterInfo::getRegAllocationHints(unsigned VirtReg, ArrayRef<MCPhysReg> Order,
+					    SmallVectorImpl<MCPhysReg> &Hints,
+					    const MachineFunction &MF,
+					    const VirtRegMap *VRM) const {
+  TargetRegisterInfo::getRegAllocationHints(VirtReg, Order, Hints, MF, VRM);
+
+  if(DisableGFree || GFreeNoAllocHints || VRM == nullptr || Order.empty())
+    return;
+
+  const MachineRegisterInfo &MRI = MF.getRegInfo();
+  GFreeModRMPredictor &Predictor = getGFreeModRMPredictor(MF.getSubtarget().getInstrInfo());
+  // For each register of Order, how many users would encode a ret.
+  std::vector<unsigned int> Penalty(Order.size(), 0);
+  std::vector<unsigned int> PhysRegs;
+  unsigned int NumUses = 0;
+
+  for(const MachineInstr &MI : MRI.reg_nodbg_instructions(VirtReg)){
+    if(NumUses++ >= GFreeAllocHintsMaxUses)
+      break;
+
+    // Rewrite every other operand with its current assignment. If one of
+    // them is not assigned yet we can't tell anything about this MI.
+    bool Known = true;
+    PhysRegs.assign(MI.getNumOperands(), 0);
+    for(unsigned int i = 0; i < MI.getNumOperands() && Known; i++){
+      const MachineOperand &MO = MI.getOperand(i);
+      if(!MO.isReg() || MO.getReg() == VirtReg)
+	continue;
+      unsigned int Reg = MO.getReg();
+      if(isVirtualRegister(Reg)){
+	if(!VRM->hasPhys(Reg)){
+	  Known = false;
+	  break;
+	}
+	Reg = VRM->getPhys(Reg);
+	if(MO.getSubReg())
+	  Reg = getSubReg(Reg, MO.getSubReg());
+      }
+      PhysRegs[i] = Reg;
+    }
+    if(!Known)
+      continue;
+
+    for(unsigned int j = 0; j < Order.size(); j++){
+      for(unsigned int i = 0; i < MI.getNumOperands(); i++){
+	const MachineOperand &MO = MI.getOperand(i);
+	if(MO.isReg() && MO.getReg() == VirtReg)
+	  PhysRegs[i] = MO.getSubReg() ? getSubReg(Order[j], MO.getSubReg()) : Order[j];
+      }
+      if(Predictor.predictContainsRet(&MI, PhysRegs) == 1)
+	Penalty[j]++;
+    }
+  }
+
+  // Nothing to avoid (or nothing we can avoid).
+  unsigned int MinPenalty = *std::min_element(Penalty.begin(), Penalty.end());
+  unsigned int MaxPenalty = *std::max_element(Penalty.begin(), Penalty.end());
+  if(MinPenalty == MaxPenalty)
+    return;
+
+  ++HintedVirtRegs;
+  // Keep the safe copy hints first, then every other safe register in the
+  // original order. The penalized ones are tried only after all of them.
+  SmallVector<MCPhysReg, 16> OldHints(Hints.begin(), Hints.end());
+  Hints.clear();
+  for(MCPhysReg Hint : OldHints){
+    auto It = std::find(Order.begin(), Order.end(), Hint);
+    if(It != Order.end() && Penalty[It - Order.begin()] == MinPenalty)
+      Hints.push_back(Hint);
+  }
+  for(unsigned int j = 0; j < Order.size(); j++){
+    if(Penalty[j] == MinPenalty &&
+       std::find(Hints.begin(), Hints.end(), Order[j]) == Hints.end())
+      Hints.push_back(Order[j]);
+  }
+  GFreeDEBUG(2, "[HINT] " << PrintReg(VirtReg) << ": " << Hints.size() << " of "
+	     << Order.size() << " registers are safe\n");
+}
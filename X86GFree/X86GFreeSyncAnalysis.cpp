@@ -0,0 +1,166 @@
+//===-- X86GFreeSyncAnalysis.cpp - Size the synchronization sleds ---------===//
+//
+//                     The LLVM Compiler Infrastructure
+//
+//===----------------------------------------------------------------------===//
+//
+// The RAP epilogues and the JCP checks are preceded by a nop sled, so that an
+// execution that is misaligned with the real instructions is resynchronized
+// before the sequence and can't jump over its first instructions. A fixed 9
+// bytes sled assumes the worst case. Here we look at the real bytes before
+// the sequence: if every misaligned decoding of them ends on an instruction
+// boundary before the sequence (or on an invalid opcode), the sled can be
+// shorter or omitted.
+//
+//===----------------------------------------------------------------------===//
+
+#include "X86GFreeSyncAnalysis.h"
+#include "X86GFreeAssembler.h"
+#include "X86GFreeUtils.h"
+#include "X86Subtarget.h"
+#include "llvm/ADT/Statistic.h"
+#include "llvm/MC/MCInst.h"
+#include "llvm/MC/MCInstrDesc.h"
+#include "llvm/Support/raw_ostream.h"
+#include <mutex>
+
+using namespace llvm;
+
+extern "C" void LLVMInitializeX86Disassembler();
+
+#define DEBUG_TYPE "gfreesync"
+STATISTIC(SledsRemoved    , "Number of synchronization sleds proven useless");
+STATISTIC(SledsShortened  , "Number of synchronization sleds shortened");
+STATISTIC(SledBytesSaved  , "Number of sled bytes saved by the synchronization analysis");
+STATISTIC(SledsUnknown    , "Number of synchronization sleds after bytes we can't encode");
+
+static cl::opt<bool> GFreeFixedSleds("gfree-fixed-sleds", cl::Hidden,
+	       cl::desc("Don't size the synchronization sleds, always emit the longest one"));
+
+// The longest x86 instruction. A misaligned decoding that starts before the
+// window has an instruction that ends inside it.
+static const unsigned int MaxInstrLength = 15;
+
+GFreeSyncAnalysis::GFreeSyncAnalysis(MachineFunction &mf, const MCDisassembler *disasm,
+				     std::unique_ptr<GFreeAssembler> &context)
+  : MF(mf), STI(mf.getSubtarget<X86Subtarget>()), AssemblerContext(context),
+    Assembler(nullptr), Disasm(disasm) {}
+
+std::unique_ptr<MCDisassembler> GFreeSyncAnalysis::createDisassembler(MachineFunction &MF){
+  // The disassembler is not initialized by the tools that only generate
+  // code.
+  static std::once_flag Initialized;
+  std::call_once(Initialized, LLVMInitializeX86Disassembler);
+  return std::unique_ptr<MCDisassembler>(
+    MF.getTarget().getTarget().createMCDisassembler(MF.getSubtarget(), MF.getContext()));
+}
+
+// The encoding of the last instructions before MI, at least MaxInstrLength
+// bytes. Boundary[i] is true if an instruction starts at Bytes[i] (the last
+// one is MI). Returns false if we can't know them.
+bool GFreeSyncAnalysis::getBytesBefore(MachineInstr *MI, std::vector<unsigned char> &Bytes,
+				       std::vector<bool> &Boundary){
+  MachineBasicBlock *MBB = MI->getParent();
+  MachineBasicBlock::iterator I = MI;
+  // The encodings, from MI backwards.
+  std::vector<std::vector<unsigned char>> Encodings;
+  unsigned int Size = 0;
+
+  while(Size < MaxInstrLength){
+    // What's before the block depends on the layout and on the alignment.
+    if(I == MBB->begin())
+      return false;
+    --I;
+    if(I->isDebugValue() || I->isCFIInstruction() || I->isKill() ||
+       I->isImplicitDef() || I->isLabel())
+      continue;
+    if(!GFreeAssembler::isEncodable(*I))
+      return false;
+    Encodings.push_back(Assembler->MachineInstrToBytes(&*I));
+    Size += Encodings.back().size();
+  }
+
+  Bytes.clear();
+  Boundary.assign(Size + 1, false);
+  for(auto E = Encodings.rbegin(); E != Encodings.rend(); ++E){
+    Boundary[Bytes.size()] = true;
+    Bytes.insert(Bytes.end(), E->begin(), E->end());
+  }
+  Boundary[Size] = true;
+  return true;
+}
+
+// True if the decoding from every offset of Bytes reaches a boundary, or an
+// invalid opcode. Bytes.size() is a boundary: it's where the sequence
+// starts.
+bool GFreeSyncAnalysis::resynchronizes(const std::vector<unsigned char> &Bytes,
+				       const std::vector<bool> &Boundary){
+  unsigned int End = Bytes.size();
+  // Good[i]: the decoding from Bytes[i] is resynchronized. Computed
+  // backwards, every path goes forward.
+  std::vector<bool> Good(End + 1, true);
+
+  for(unsigned int i = End; i-- > 0; ){
+    if(Boundary[i])
+      continue;
+    MCInst Inst;
+    uint64_t Size;
+    ArrayRef<uint8_t> Avail(&Bytes[i], End - i);
+    if(Disasm->getInstruction(Inst, Size, Avail, i, nulls(), nulls()) != MCDisassembler::Success){
+      // An invalid opcode faults. But with less than MaxInstrLength bytes
+      // it might be just truncated: it would read the sequence.
+      Good[i] = End - i >= MaxInstrLength;
+    }
+    else{
+      // A misaligned branch goes who knows where.
+      const MCInstrDesc &Desc = STI.getInstrInfo()->get(Inst.getOpcode());
+      Good[i] = !Desc.isBranch() && !Desc.isCall() && !Desc.isReturn() &&
+	!Desc.isIndirectBranch() && Good[i + Size];
+    }
+    if(!Good[i]){
+      GFreeDEBUG(3, "[SYNC] misaligned path from offset " << i << " of " << End << "\n");
+      return false;
+    }
+  }
+  return true;
+}
+
+unsigned int GFreeSyncAnalysis::getSledLength(MachineInstr *MI, unsigned int MaxLength){
+  if(GFreeFixedSleds || !Disasm)
+    return MaxLength;
+
+  // The encoding context adds a temporary block to MF, don't leave it there
+  // while the callers walk the function.
+  Assembler = getGFreeAssembler(AssemblerContext, MF);
+  std::vector<unsigned char> Prefix;
+  std::vector<bool> PrefixBoundary;
+  bool Known = getBytesBefore(MI, Prefix, PrefixBoundary);
+  Assembler->release();
+  if(!Known){
+    ++SledsUnknown;
+    return MaxLength;
+  }
+
+  for(unsigned int Length = 0; Length < MaxLength; Length++){
+    std::vector<unsigned int> Starts;
+    std::vector<unsigned char> Bytes = Prefix;
+    std::vector<unsigned char> Sled = getNopSledBytes(STI, Length, Starts);
+    Bytes.insert(Bytes.end(), Sled.begin(), Sled.end());
+    std::vector<bool> Boundary = PrefixBoundary;
+    Boundary.resize(Bytes.size() + 1, false);
+    for(unsigned int Start : Starts)
+      Boundary[Prefix.size() + Start] = true;
+    Boundary[Bytes.size()] = true;
+
+    if(resynchronizes(Bytes, Boundary)){
+      GFreeDEBUG(1, "[SYNC] " << Length << " bytes sled before: " << *MI);
+      if(Length == 0)
+	++SledsRemoved;
+      else
+	++SledsShortened;
+      SledBytesSaved += MaxLength - Length;
+      return Length;
+    }
+  }
+  return MaxLength;
+}
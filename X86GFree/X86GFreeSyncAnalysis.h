@@ -0,0 +1,48 @@
+#ifndef GFREESYNCANALYSIS_H_
+#define GFREESYNCANALYSIS_H_
+
+#include "llvm/CodeGen/MachineFunction.h"
+#include "llvm/CodeGen/MachineInstr.h"
+#include "llvm/MC/MCDisassembler.h"
+#include <memory>
+
+namespace llvm {
+
+  class GFreeAssembler;
+  class X86Subtarget;
+
+  // Sizes the synchronization sled in front of a protected sequence (RAP
+  // epilogue, JCP check). The sled is needed only if a misaligned decoding
+  // of the bytes before the sequence can run into it: we decode from every
+  // offset of the last MaxInstrLength bytes before it, and return the
+  // shortest sled such that every path ends on an instruction boundary up
+  // to the sequence (or on an invalid opcode).
+  class GFreeSyncAnalysis {
+  public:
+    // Disasm comes from createDisassembler, the caller keeps it for all the
+    // functions. Without one, every sled gets MaxLength. AssemblerContext is
+    // the caller's encoding context (see getGFreeAssembler).
+    GFreeSyncAnalysis(MachineFunction &MF, const MCDisassembler *Disasm,
+		      std::unique_ptr<GFreeAssembler> &AssemblerContext);
+
+    static std::unique_ptr<MCDisassembler> createDisassembler(MachineFunction &MF);
+
+    // The sled length for the sequence that starts before MI, at most
+    // MaxLength (which is returned when the bytes before MI are not
+    // known: calls, branches, block boundaries...).
+    unsigned int getSledLength(MachineInstr *MI, unsigned int MaxLength);
+
+  private:
+    MachineFunction &MF;
+    const X86Subtarget &STI;
+    std::unique_ptr<GFreeAssembler> &AssemblerContext;
+    GFreeAssembler *Assembler;
+    const MCDisassembler *Disasm;
+
+    bool getBytesBefore(MachineInstr *MI, std::vector<unsigned char> &Bytes,
+			std::vector<bool> &Boundary);
+    bool resynchronizes(const std::vector<unsigned char> &Bytes, const std::vector<bool> &Boundary);
+  };
+
+}
+#endif
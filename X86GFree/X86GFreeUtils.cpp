@@ -101,6 +101,23 @@ int getORriOpcode(unsigned int size){
   return 0;
 }
 
+int getNOTrOpcode(unsigned int size){
+  if( size == 1 ){
+    return X86::NOT8r;
+  }
+  if( size == 2 ){
+    return X86::NOT16r;
+  }
+  if( size == 4 ){
+    return X86::NOT32r;
+  }
+  if( size == 8 ){
+    return X86::NOT64r;
+  }
+  assert(false && "[getNOTopcode] We should never get here!");
+  return 0;
+}
+
 
 // python listcalljmpstar.py
 int values_to_avoid[] = {0x10,0x11,0x12,0x13,0x16,0x17,0x18,0x19,0x1a,0x1b,0x1e,
@@ -152,6 +169,8 @@ bool isIndirectCall(MachineInstr *MI){
   case X86::FARCALL64:
   case X86::TAILJMPr64:
   case X86::TAILJMPm64:
+  case X86::TAILJMPr64_REX:
+  case X86::TAILJMPm64_REX:
   case X86::TCRETURNri64:
   case X86::TCRETURNmi64:
     return true;
@@ -160,6 +179,34 @@ bool isIndirectCall(MachineInstr *MI){
   }
 }
 
+// TCRETURN* before the epilogue is emitted, TAILJMP* after.
+bool isTailCall(MachineInstr *MI){
+  return MI->isReturn() && MI->isCall();
+}
+
+unsigned int getReturnAddressScratchReg(MachineInstr *MI){
+  // Caller saved. The arguments of a tail call (and the target) are
+  // uses of the jump.
+  static const unsigned int Candidates[] = {
+    X86::R11, X86::R10, X86::R9, X86::R8, X86::RCX,
+    X86::RDX, X86::RSI, X86::RDI, X86::RAX
+  };
+  const TargetRegisterInfo *TRI = MI->getParent()->getParent()->getSubtarget().getRegisterInfo();
+
+  if(!isTailCall(MI))
+    return X86::R11;
+
+  for(unsigned int Reg : Candidates){
+    bool Used = false;
+    for(const MachineOperand &MO : MI->operands())
+      if(MO.isReg() && MO.getReg() && TRI->regsOverlap(MO.getReg(), Reg))
+	Used = true;
+    if(!Used)
+      return Reg;
+  }
+  llvm_unreachable("A tail jump can't read every caller saved register");
+}
+
 bool contains(std::vector<llvm::MachineInstr*> v, MachineInstr* mbb){
   return std::find(std::begin(v), std::end(v), mbb) != std::end(v);
 }
@@ -272,6 +319,107 @@ void emitNop(MachineInstr *MI, int count){
   }
 }
 
+static cl::opt<bool> GFreeSingleByteNops("gfree-single-byte-nops", cl::Hidden,
+	       cl::desc("Emit the synchronization sleds with one byte nops"));
+
+// The multi-byte nops of the sleds. Every suffix of each of them decodes to
+// instructions that end exactly where the nop ends, or that fault, so a
+// sled made of them resynchronizes a misaligned execution like a sled of
+// one byte nops does. The usual 00 displacements would eat the bytes that
+// follow, so the disp8s are 0x90 (nop) and the disp32s 0xf4 (hlt, which
+// faults in user mode). None of the suffixes ends with a prefix byte that
+// would fuse with the first instruction of the protected sequence.
+struct GFreeNopForm {
+  unsigned int Opcode;
+  unsigned int Segment;
+  unsigned int Base;
+  int Disp;
+  const char *Bytes;
+};
+static const GFreeNopForm NopForms[] = {
+  {X86::NOOPL, 0,       X86::RAX, -0x70,       "\x0f\x1f\x40\x90"},
+  {X86::NOOPW, 0,       X86::RAX, -0x70,       "\x66\x0f\x1f\x40\x90"},
+  {X86::NOOPW, X86::CS, X86::RAX, -0x70,       "\x2e\x66\x0f\x1f\x40\x90"},
+  {X86::NOOPW, X86::CS, X86::RSP, -0x70,       "\x2e\x66\x0f\x1f\x44\x24\x90"},
+  {X86::NOOPW, 0,       X86::RAX, -0x0b0b0b0c, "\x66\x0f\x1f\x80\xf4\xf4\xf4\xf4"},
+  {X86::NOOPW, X86::CS, X86::RAX, -0x0b0b0b0c, "\x2e\x66\x0f\x1f\x80\xf4\xf4\xf4\xf4"},
+  {X86::NOOPW, X86::CS, X86::RSP, -0x0b0b0b0c, "\x2e\x66\x0f\x1f\x84\x24\xf4\xf4\xf4\xf4"},
+};
+static const unsigned int MinNopFormLength = 4;
+
+// The longest nop the subtarget decodes at full speed: Atom and Silvermont
+// are slow on instructions longer than 7 bytes, the other cores on more
+// than 3 prefixes (none of ours has).
+static unsigned int getMaxNopLength(const X86Subtarget &STI){
+  if(GFreeSingleByteNops || !STI.is64Bit())
+    return 1;
+  if(STI.isAtom() || STI.isSLM())
+    return 7;
+  return MinNopFormLength + array_lengthof(NopForms) - 1;
+}
+
+// The sizes of the fewest nops that make a sled of Length bytes.
+static void planNopSled(const X86Subtarget &STI, unsigned int Length, SmallVectorImpl<unsigned int> &Sizes){
+  unsigned int MaxLength = getMaxNopLength(STI);
+  while(Length > 0){
+    unsigned int Size = std::min(Length, MaxLength);
+    if(Size < MinNopFormLength && Size >= 2)
+      Size = 2; // 66 90
+    Sizes.push_back(Size);
+    Length -= Size;
+  }
+}
+
+void emitNopSled(MachineInstr *MI, unsigned int Length){
+  MachineBasicBlock *MBB =  MI->getParent();
+  MachineFunction *MF = MBB->getParent();
+  const X86Subtarget &STI = MF->getSubtarget<X86Subtarget>();
+  const X86InstrInfo &TII = *STI.getInstrInfo();
+  DebugLoc DL = MI->getDebugLoc();
+  MachineInstrBuilder MIB;
+  SmallVector<unsigned int, 4> Sizes;
+  planNopSled(STI, Length, Sizes);
+
+  for(unsigned int Size : Sizes){
+    if(Size >= MinNopFormLength){
+      const GFreeNopForm &Form = NopForms[Size - MinNopFormLength];
+      MIB = BuildMI(*MBB, MI, DL, TII.get(Form.Opcode))
+	.addReg(Form.Base).addImm(1).addReg(0).addImm(Form.Disp).addReg(Form.Segment);
+    }
+    else if(Size == 2){
+      MIB = BuildMI(*MBB, MI, DL, TII.get(X86::XCHG16ar)).addReg(X86::AX);
+    }
+    else{
+      MIB = BuildMI(*MBB, MI, DL, TII.get(X86::NOOP));
+    }
+    GFreeDEBUG(2, "> " << *MIB);
+  }
+}
+
+std::vector<unsigned char> getNopSledBytes(const X86Subtarget &STI, unsigned int Length,
+					   std::vector<unsigned int> &Starts){
+  std::vector<unsigned char> Bytes;
+  SmallVector<unsigned int, 4> Sizes;
+  planNopSled(STI, Length, Sizes);
+  Starts.clear();
+
+  for(unsigned int Size : Sizes){
+    Starts.push_back(Bytes.size());
+    if(Size >= MinNopFormLength){
+      const char *Form = NopForms[Size - MinNopFormLength].Bytes;
+      Bytes.insert(Bytes.end(), Form, Form + Size);
+    }
+    else if(Size == 2){
+      Bytes.push_back(0x66);
+      Bytes.push_back(0x90);
+    }
+    else{
+      Bytes.push_back(0x90);
+    }
+  }
+  return Bytes;
+}
+
 void emitNopAfter(MachineInstr *MI, int count){
   MachineBasicBlock *MBB =  MI->getParent();
   MachineFunction *MF = MBB->getParent();
@@ -316,6 +464,46 @@ MachineInstrBuilder popReg(MachineInstr *MI, unsigned int Reg, unsigned int flag
   return MIB;
 }
 
+// There's no push for XMM/YMM registers: lea rsp,[rsp-16/32] (the flags
+// may be live) and movups/vmovups [rsp],Reg. Returns the lea.
+MachineInstrBuilder pushVectorReg(MachineInstr *MI, unsigned int Reg, unsigned int flags){
+  MachineBasicBlock *MBB =  MI->getParent();
+  MachineFunction *MF = MBB->getParent();
+  const X86Subtarget &STI = MF->getSubtarget<X86Subtarget>();
+  const X86InstrInfo &TII = *STI.getInstrInfo();
+  DebugLoc DL = MI->getDebugLoc();
+  bool isYMM = X86::VR256RegClass.contains(Reg);
+  MachineInstrBuilder MIB, LeaMIB;
+  LeaMIB = addRegOffset(BuildMI(*MBB, MI, DL, TII.get(X86::LEA64r), X86::RSP),
+			X86::RSP, false, isYMM ? -32 : -16);
+  GFreeDEBUG(1, "> " << *LeaMIB);
+  MIB = addDirectMem(BuildMI(*MBB, MI, DL, TII.get(isYMM ? X86::VMOVUPSYmr :
+						    STI.hasAVX() ? X86::VMOVUPSmr : X86::MOVUPSmr)),
+		     X86::RSP)
+    .addReg(Reg, RegState::Kill | flags);
+  GFreeDEBUG(1, "> " << *MIB);
+  return LeaMIB;
+}
+
+// Returns the load, the first of the two instructions.
+MachineInstrBuilder popVectorReg(MachineInstr *MI, unsigned int Reg, unsigned int flags){
+  MachineBasicBlock *MBB =  MI->getParent();
+  MachineFunction *MF = MBB->getParent();
+  const X86Subtarget &STI = MF->getSubtarget<X86Subtarget>();
+  const X86InstrInfo &TII = *STI.getInstrInfo();
+  DebugLoc DL = MI->getDebugLoc();
+  bool isYMM = X86::VR256RegClass.contains(Reg);
+  MachineInstrBuilder MIB, LoadMIB;
+  LoadMIB = addDirectMem(BuildMI(*MBB, MI, DL, TII.get(isYMM ? X86::VMOVUPSYrm :
+							STI.hasAVX() ? X86::VMOVUPSrm : X86::MOVUPSrm))
+			 .addReg(Reg, RegState::Define | flags), X86::RSP);
+  GFreeDEBUG(1, "> " << *LoadMIB);
+  MIB = addRegOffset(BuildMI(*MBB, MI, DL, TII.get(X86::LEA64r), X86::RSP),
+		     X86::RSP, false, isYMM ? 32 : 16);
+  GFreeDEBUG(1, "> " << *MIB);
+  return LoadMIB;
+}
+
 void pushEFLAGS(MachineInstr *MI){
   MachineBasicBlock *MBB =  MI->getParent();
   MachineFunction *MF = MBB->getParent();
@@ -341,6 +529,8 @@ void popEFLAGS(MachineInstr *MI){
 
 // PUSHF64 %RSP<imp-def>, %RSP<imp-use>, %EFLAGS<imp-use>
 // TODO: http://reviews.llvm.org/D6629
+// The flags must be live before MI (defined above it or live into its
+// MBB): only a live value is saved.
 void pushEFLAGSinline(MachineInstr *MI, unsigned int saveRegEFLAGS){
   MachineBasicBlock *MBB =  MI->getParent();
   MachineFunction *MF = MBB->getParent();
@@ -380,11 +570,6 @@ void pushEFLAGSinline(MachineInstr *MI, unsigned int saveRegEFLAGS){
   // MBB->sortUniqueLiveIns();
 
   // 4#
-  if ( MachineBasicBlock::LQR_Dead ==
-       MBB->computeRegisterLiveness((MF->getRegInfo().getTargetRegisterInfo()), X86::EFLAGS, MI, 5000)){
-    MIB = BuildMI(*MBB, MI, DL, TII.get(TargetOpcode::IMPLICIT_DEF), X86::EFLAGS);       
-  }
-
   MIB = BuildMI(*MBB, MI, DL, TII.get(X86::INLINEASM))
     .addExternalSymbol("pushfq")
     .addImm(0)
@@ -440,61 +625,67 @@ void popEFLAGSinline(MachineInstr *MI, unsigned int saveRegEFLAGS){
   GFreeDEBUG(0, "> " << *MIB); 	    
 }
 
-bool needToSaveEFLAGS(MachineInstr *MI){
-  MachineBasicBlock *MBB =  MI->getParent();
-  MachineBasicBlock::iterator MBBI, MBBIE;
-  MBBI = MI;
-  MBBIE = MBB->end();
-  MachineInstr *CurrentMI;
-  unsigned int i;
-  // errs() << "TMP DUMPL " << *MBB;
-  bool use, def;
-  use = false;
-  def = false;
-
-  for (; ; MBBI++) {
-    
-    // If we are at the end of the MBB, follow the successor if and only if there is 
-    // one successor.
-    while(MBBI == MBBIE && MBB->succ_size() == 1){
-      MBB = *MBB->succ_begin();
-      MBBI =  MBB->begin();
-      MBBIE = MBB->end(); 
-    }
-
-    if(MBBI == MBBIE && MBB->succ_size() != 1){ // If there are > 1 successors, stop searching.
-      // errs() << "Found anything1!\n";
-      return 1;
-    }
-
-    CurrentMI = MBBI;
-    // errs() << "\t[NS]: " << *CurrentMI;
-
-    if( CurrentMI->isReturn() || CurrentMI->isCall() ){ // We do not preserve eflags across return. It should be safe.
-      // errs() << " Found ret!\n";
-      return 0;      
-    }
+bool GFreeEFLAGSLiveness::transfer(const MachineInstr &MI, bool LiveAfterMI){
+  if(MI.isReturn() || MI.isCall()) // We do not preserve eflags across return. It should be safe.
+    return false;
+  if(MI.readsRegister(X86::EFLAGS))
+    return true;
+  if(MI.definesRegister(X86::EFLAGS))
+    return false;
+  return LiveAfterMI;
+}
 
-    for(i=0; i<CurrentMI->getNumOperands(); i++){
-      MachineOperand MO = CurrentMI->getOperand(i);
-      if(!MO.isReg() || (MO.getReg() != X86::EFLAGS))
-	continue;
-      if(MO.isUse()){
-	// errs() << " Found use!\n";
-	use = 1;
+void GFreeEFLAGSLiveness::compute(MachineFunction &MF){
+  LiveIn.reset();
+  LiveIn.resize(MF.getNumBlockIDs());
+  LiveOut.reset();
+  LiveOut.resize(MF.getNumBlockIDs());
+  LiveAfter.clear();
+
+  // Classic fixpoint, the bits only go from dead to live. Visiting the
+  // blocks bottom-up makes it converge in a couple of iterations.
+  bool Changed = true;
+  while(Changed){
+    Changed = false;
+    for(auto MBB = MF.rbegin(), E = MF.rend(); MBB != E; ++MBB){
+      bool Live = false;
+      for(MachineBasicBlock *Succ : MBB->successors())
+	Live |= LiveIn.test(Succ->getNumber());
+      if(Live && !LiveOut.test(MBB->getNumber())){
+	LiveOut.set(MBB->getNumber());
+	Changed = true;
       }
-      if(MO.isDef()){
-	// errs() << " Found def!\n";
-	def = 1;
+      for(auto MI = MBB->rbegin(), ME = MBB->rend(); MI != ME; ++MI)
+	Live = transfer(*MI, Live);
+      if(Live && !LiveIn.test(MBB->getNumber())){
+	LiveIn.set(MBB->getNumber());
+	Changed = true;
       }
     }
+  }
 
-    if(use == 1) return 1;
-    if(def == 1) return 0;
+  for(MachineBasicBlock &MBB : MF){
+    bool Live = LiveOut.test(MBB.getNumber());
+    for(auto MI = MBB.rbegin(), ME = MBB.rend(); MI != ME; ++MI){
+      LiveAfter[&*MI] = Live;
+      Live = transfer(*MI, Live);
+    }
   }
-  
-  // errs() << "Found anything!\n";
-  return 1;
+}
+
+bool GFreeEFLAGSLiveness::isLiveAfter(const MachineInstr *MI) const{
+  auto It = LiveAfter.find(MI);
+  return It == LiveAfter.end() ? true : It->second; // Unknown: be conservative.
+}
+
+bool GFreeEFLAGSLiveness::isLiveBefore(const MachineInstr *MI) const{
+  return transfer(*MI, isLiveAfter(MI));
+}
+
+void GFreeEFLAGSLiveness::addInstr(MachineInstr *NewMI){
+  MachineBasicBlock *MBB = NewMI->getParent();
+  MachineBasicBlock::iterator Next = std::next(MachineBasicBlock::iterator(NewMI));
+  LiveAfter[NewMI] = (Next == MBB->end()) ? LiveOut.test(MBB->getNumber()) : isLiveBefore(Next);
 }
 
 bool containsRet(std::vector<unsigned char> MIbytes){
@@ -2,6 +2,9 @@
 #include <iomanip>
 #include "llvm/CodeGen/MachineInstr.h"
 #include "llvm/CodeGen/MachineInstrBuilder.h"
+#include "llvm/CodeGen/MachineFunction.h"
+#include "llvm/ADT/BitVector.h"
+#include "llvm/ADT/DenseMap.h"
 #include "llvm/Target/TargetRegisterInfo.h"
 #include "llvm/Support/CommandLine.h"
 
@@ -14,6 +17,10 @@
 
 using namespace llvm;
 
+namespace llvm {
+  class X86Subtarget;
+}
+
 /* static cl::opt<bool>  */
 /* DisableGFree("disable-gfree", cl::Hidden, */
 /* 	       cl::desc("Disable GFree protections")); */
@@ -23,8 +30,13 @@ extern cl::opt<bool> DisableGFree;
 
 
 std::pair<int64_t, int64_t> splitInt(int64_t Imm, int Size);
+bool FFblacklist(int I);
 
 bool isIndirectCall(MachineInstr *MI);
+bool isTailCall(MachineInstr *MI);
+// The register the RAP epilogue before the return MI can clobber. r11,
+// unless a tail jump reads it.
+unsigned int getReturnAddressScratchReg(MachineInstr *MI);
 bool isMove(MachineInstr *MI);
 bool isTest(MachineInstr *MI);
 bool isCompare(MachineInstr *MI);
@@ -36,15 +48,22 @@ int getMOVriOpcode(unsigned int size);
 int getADDrrOpcode(unsigned int size);
 int getSUBrrOpcode(unsigned int size);
 int getORriOpcode(unsigned int size);
+int getNOTrOpcode(unsigned int size);
 
 bool containsRet(std::vector<unsigned char> MIbytes);
 bool contains(std::vector<llvm::MachineInstr*> v, MachineInstr* mbb);
 
 void emitNop(MachineInstr *MI, int count=1);
 void emitNopAfter(MachineInstr *MI, int count=1);
+// A synchronization sled of Length bytes with the fewest nops.
+void emitNopSled(MachineInstr *MI, unsigned int Length);
+// The bytes of that sled, Starts gets the offset of each nop.
+std::vector<unsigned char> getNopSledBytes(const X86Subtarget &STI, unsigned int Length,
+					   std::vector<unsigned int> &Starts);
 MachineInstrBuilder pushReg(MachineInstr *MI, unsigned int Reg, unsigned int flags=0);
 MachineInstrBuilder popReg(MachineInstr *MI, unsigned int Reg, unsigned int flags=0);
-bool needToSaveEFLAGS(MachineInstr *MI);
+MachineInstrBuilder pushVectorReg(MachineInstr *MI, unsigned int Reg, unsigned int flags=0);
+MachineInstrBuilder popVectorReg(MachineInstr *MI, unsigned int Reg, unsigned int flags=0);
 void pushEFLAGS(MachineInstr *MI);
 void popEFLAGS(MachineInstr *MI);
 void pushEFLAGSinline(MachineInstr *MI, unsigned int saveRegEFLAGS);
@@ -52,4 +71,24 @@ void popEFLAGSinline(MachineInstr *MI, unsigned int saveRegEFLAGS);
 
 void dumpSuccessors(MachineBasicBlock *fromMBB);
 
+// Backward liveness of EFLAGS over the whole CFG, computed once per function.
+// We don't preserve the flags across calls and returns, so they kill them.
+class GFreeEFLAGSLiveness {
+ public:
+  void compute(MachineFunction &MF);
+  // Can EFLAGS be read after MI, before being redefined? O(1).
+  bool isLiveAfter(const MachineInstr *MI) const;
+  bool isLiveBefore(const MachineInstr *MI) const;
+  bool isLiveOut(const MachineBasicBlock *MBB) const { return LiveOut.test(MBB->getNumber()); }
+  // NewMI was just inserted: its answer is the one of the next instruction.
+  // Nothing is updated above NewMI, we assume that the inserted code
+  // preserves the flags that are live there.
+  void addInstr(MachineInstr *NewMI);
+
+ private:
+  BitVector LiveIn, LiveOut;
+  DenseMap<const MachineInstr*, bool> LiveAfter;
+  static bool transfer(const MachineInstr &MI, bool LiveAfterMI);
+};
+
 #endif
@@ -0,0 +1,221 @@
+//===-- X86GFreeVectorImm.cpp - Evil-free SSE/AVX imm8 operands -----------===//
+//
+//                     The LLVM Compiler Infrastructure
+//
+//===----------------------------------------------------------------------===//
+//
+// This file rewrites the vector instructions whose imm8 is one of c2, c3, ca
+// and cb. These are common shuffle masks (11 00 00 10: lanes 2, 0, 0, 3),
+// and none of them is in the maps of GFreeImmediateRecon: the immediate
+// can't be moved in a register, but the same shuffle can be expressed with
+// other masks. All the alternatives leave EFLAGS alone.
+//
+//===----------------------------------------------------------------------===//
+
+#include "X86GFreeVectorImm.h"
+#include "X86GFreeUtils.h"
+#include "X86.h"
+#include "X86Subtarget.h"
+#include "llvm/ADT/Statistic.h"
+#include "llvm/CodeGen/MachineInstrBuilder.h"
+#include "llvm/CodeGen/MachineRegisterInfo.h"
+#include "llvm/Support/raw_ostream.h"
+
+using namespace llvm;
+
+#define DEBUG_TYPE "gfreevectorimm"
+STATISTIC(SplitPermutes   , "Number of evil 4 lane permutes split in two permutes");
+STATISTIC(PrePermuted     , "Number of evil shufps/insertps whose source was permuted first");
+STATISTIC(SwappedBlends   , "Number of evil blends rewritten with swapped sources");
+STATISTIC(ClearedImmBits  , "Number of evil vperm2f128/vperm2i128 whose ignored bits were cleared");
+
+// The 2 bit selector of lane i.
+static unsigned int lane(unsigned int Imm, unsigned int i){
+  return (Imm >> (2 * i)) & 3;
+}
+
+bool GFreeVectorImmRewriter::isSafeImm8(int64_t Imm){
+  std::pair<int64_t, int64_t> split = splitInt(Imm & 0xff, 8);
+  return split.first == 0 && split.second == 0;
+}
+
+// Two safe masks A and B such that permuting with A and then with B is
+// permuting with Imm: lane i of the result is lane A[B[i]] of the source.
+static bool findPermutePair(unsigned int Imm, unsigned int &A, unsigned int &B){
+  for(B = 0; B < 256; B++){
+    if(!GFreeVectorImmRewriter::isSafeImm8(B))
+      continue;
+    for(A = 0; A < 256; A++){
+      if(!GFreeVectorImmRewriter::isSafeImm8(A))
+	continue;
+      unsigned int i = 0;
+      while(i < 4 && lane(A, lane(B, i)) == lane(Imm, i))
+	i++;
+      if(i == 4)
+	return true;
+    }
+  }
+  return false;
+}
+
+void GFreeVectorImmRewriter::reset(MachineFunction &mf){
+  MF = &mf;
+  STI = &MF->getSubtarget<X86Subtarget>();
+  TII = STI->getInstrInfo();
+  MRI = &MF->getRegInfo();
+}
+
+// permute t, src, A; permute dst, t, B. Two shuffle uops instead of one.
+unsigned int GFreeVectorImmRewriter::rewritePermute(MachineInstr *MI, unsigned int Imm){
+  unsigned int A, B;
+  if(!findPermutePair(Imm, A, B))
+    return 0;
+
+  MachineBasicBlock &MBB = *MI->getParent();
+  unsigned int DstReg = MI->getOperand(0).getReg();
+  const MachineOperand &Src = MI->getOperand(1);
+  unsigned int TmpReg = MRI->createVirtualRegister(MRI->getRegClass(DstReg));
+  MachineInstrBuilder MIB;
+
+  MIB = BuildMI(MBB, MI, MI->getDebugLoc(), TII->get(MI->getOpcode()), TmpReg)
+    .addReg(Src.getReg(), 0, Src.getSubReg())
+    .addImm(A);
+  GFreeDEBUG(0, "> " << *MIB);
+  MIB = BuildMI(MBB, MI, MI->getDebugLoc(), TII->get(MI->getOpcode()), DstReg)
+    .addReg(TmpReg)
+    .addImm(B);
+  GFreeDEBUG(0, "> " << *MIB);
+  ++SplitPermutes;
+  return 2;
+}
+
+// Permute the four 32 bit lanes (of each 128 bit lane) of Src, staying in
+// the float domain. Returns the new register.
+unsigned int GFreeVectorImmRewriter::emitLanePermute(MachineInstr *MI, unsigned int Src, unsigned int Imm,
+						     bool Is256){
+  unsigned int TmpReg = MRI->createVirtualRegister(MRI->getRegClass(MI->getOperand(0).getReg()));
+  MachineInstrBuilder MIB;
+  if(STI->hasAVX())
+    MIB = BuildMI(*MI->getParent(), MI, MI->getDebugLoc(),
+		  TII->get(Is256 ? X86::VPERMILPSYri : X86::VPERMILPSri), TmpReg)
+      .addReg(Src).addImm(Imm);
+  else
+    MIB = BuildMI(*MI->getParent(), MI, MI->getDebugLoc(), TII->get(X86::SHUFPSrri), TmpReg)
+      .addReg(Src).addReg(Src).addImm(Imm);
+  GFreeDEBUG(0, "> " << *MIB);
+  return TmpReg;
+}
+
+// shufps dst, a, b, Imm takes lanes 2 and 3 from b: permute b first so that
+// their selectors (the evil high nibble) become something else.
+unsigned int GFreeVectorImmRewriter::rewriteSHUFPS(MachineInstr *MI, unsigned int Imm){
+  const MachineOperand &Src2 = MI->getOperand(2);
+  if(Src2.getSubReg() || !TargetRegisterInfo::isVirtualRegister(Src2.getReg()))
+    return 0;
+
+  for(unsigned int P = 0; P < 256; P++){
+    if(!isSafeImm8(P))
+      continue;
+    for(unsigned int S2 = 0; S2 < 4; S2++){
+      for(unsigned int S3 = 0; S3 < 4; S3++){
+	unsigned int NewImm = (Imm & 0x0f) | (S2 << 4) | (S3 << 6);
+	if(lane(P, S2) != lane(Imm, 2) || lane(P, S3) != lane(Imm, 3) || !isSafeImm8(NewImm))
+	  continue;
+	unsigned int TmpReg = emitLanePermute(MI, Src2.getReg(), P, MI->getOpcode() == X86::VSHUFPSYrri);
+	MachineInstr *NewMI = MF->CloneMachineInstr(MI);
+	NewMI->getOperand(2).setReg(TmpReg);
+	NewMI->getOperand(2).setIsKill(false);
+	NewMI->getOperand(3).setImm(NewImm);
+	MI->getParent()->insert(MI, NewMI);
+	GFreeDEBUG(0, "> " << *NewMI);
+	++PrePermuted;
+	return 2;
+      }
+    }
+  }
+  return 0;
+}
+
+// blend dst, a, b, Imm == blend dst, b, a, ~Imm. The complement of c2, c3,
+// ca and cb is 3d, 3c, 35 and 34.
+unsigned int GFreeVectorImmRewriter::rewriteBlend(MachineInstr *MI, unsigned int Imm){
+  unsigned int NewImm = ~Imm & 0xff;
+  if(!isSafeImm8(NewImm))
+    return 0;
+  MachineInstr *NewMI = MF->CloneMachineInstr(MI);
+  MachineOperand Src1 = MI->getOperand(1);
+  MachineOperand Src2 = MI->getOperand(2);
+  NewMI->getOperand(1).ChangeToRegister(Src2.getReg(), false, false, false);
+  NewMI->getOperand(1).setSubReg(Src2.getSubReg());
+  NewMI->getOperand(2).ChangeToRegister(Src1.getReg(), false, false, false);
+  NewMI->getOperand(2).setSubReg(Src1.getSubReg());
+  NewMI->getOperand(3).setImm(NewImm);
+  MI->getParent()->insert(MI, NewMI);
+  GFreeDEBUG(0, "> " << *NewMI);
+  ++SwappedBlends;
+  return 1;
+}
+
+// The same instruction with another immediate.
+unsigned int GFreeVectorImmRewriter::rewriteWithImm(MachineInstr *MI, unsigned int Imm){
+  if(!isSafeImm8(Imm))
+    return 0;
+  MachineInstr *NewMI = MF->CloneMachineInstr(MI);
+  NewMI->getOperand(NewMI->getNumExplicitOperands() - 1).setImm(Imm);
+  MI->getParent()->insert(MI, NewMI);
+  GFreeDEBUG(0, "> " << *NewMI);
+  ++ClearedImmBits;
+  return 1;
+}
+
+// insertps dst, a, b, Imm inserts lane Imm[7:6] of b: with c2..cb it's lane
+// 3. Move it to lane 0 first and select lane 0.
+unsigned int GFreeVectorImmRewriter::rewriteINSERTPS(MachineInstr *MI, unsigned int Imm){
+  const MachineOperand &Src2 = MI->getOperand(2);
+  unsigned int P = Imm >> 6;
+  unsigned int NewImm = Imm & 0x3f;
+  if(Src2.getSubReg() || !TargetRegisterInfo::isVirtualRegister(Src2.getReg()) ||
+     !isSafeImm8(P) || !isSafeImm8(NewImm))
+    return 0;
+  unsigned int TmpReg = emitLanePermute(MI, Src2.getReg(), P, false);
+  MachineInstr *NewMI = MF->CloneMachineInstr(MI);
+  NewMI->getOperand(2).setReg(TmpReg);
+  NewMI->getOperand(2).setIsKill(false);
+  NewMI->getOperand(3).setImm(NewImm);
+  MI->getParent()->insert(MI, NewMI);
+  GFreeDEBUG(0, "> " << *NewMI);
+  ++PrePermuted;
+  return 2;
+}
+
+unsigned int GFreeVectorImmRewriter::rewrite(MachineInstr *MI){
+  unsigned int NumOps = MI->getNumExplicitOperands();
+  if(NumOps < 3 || !MI->getOperand(NumOps - 1).isImm() || !MI->getOperand(0).isReg() ||
+     !TargetRegisterInfo::isVirtualRegister(MI->getOperand(0).getReg()))
+    return 0;
+  unsigned int Imm = MI->getOperand(NumOps - 1).getImm() & 0xff;
+  if(isSafeImm8(Imm))
+    return 0;
+
+  switch(MI->getOpcode()){
+  // dst, src, imm: 4 x 2 bit selectors.
+  case X86::PSHUFDri:   case X86::VPSHUFDri:   case X86::VPSHUFDYri:
+  case X86::PSHUFLWri:  case X86::VPSHUFLWri:  case X86::VPSHUFLWYri:
+  case X86::PSHUFHWri:  case X86::VPSHUFHWri:  case X86::VPSHUFHWYri:
+  case X86::VPERMILPSri: case X86::VPERMILPSYri:
+  case X86::VPERMQYri:  case X86::VPERMPDYri:
+    return rewritePermute(MI, Imm);
+
+  // dst, src1, src2, imm.
+  case X86::SHUFPSrri:  case X86::VSHUFPSrri:  case X86::VSHUFPSYrri:
+    return rewriteSHUFPS(MI, Imm);
+  case X86::PBLENDWrri: case X86::VPBLENDWrri: case X86::VPBLENDWYrri:
+  case X86::VPBLENDDYrri: case X86::VBLENDPSYrri:
+    return rewriteBlend(MI, Imm);
+  case X86::VPERM2F128rr: case X86::VPERM2I128rr:
+    return rewriteWithImm(MI, Imm & ~0x44);
+  case X86::INSERTPSrr: case X86::VINSERTPSrr:
+    return rewriteINSERTPS(MI, Imm);
+  }
+  return 0;
+}
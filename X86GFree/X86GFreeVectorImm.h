@@ -0,0 +1,49 @@
+#ifndef GFREEVECTORIMM_H_
+#define GFREEVECTORIMM_H_
+
+#include "llvm/CodeGen/MachineFunction.h"
+#include "llvm/CodeGen/MachineInstr.h"
+
+namespace llvm {
+
+  class X86Subtarget;
+  class TargetInstrInfo;
+  class MachineRegisterInfo;
+
+  // Rewrites the SSE/AVX instructions whose imm8 (shuffle, blend or lane
+  // selection mask) is a ret into an equivalent sequence with safe imm8s:
+  // - 4 x 2 bit permutes (pshufd, pshuflw/hw, vpermilps, vpermq/pd): two
+  //   permutes whose composition is the original one;
+  // - shufps: the two lanes taken from the second source are moved first,
+  //   so that their selectors become safe;
+  // - word/dword blends: the sources are swapped and the mask complemented;
+  // - vperm2f128/vperm2i128: the ignored bits 2 and 6 are cleared;
+  // - insertps: the source element is moved to lane 0 first.
+  class GFreeVectorImmRewriter {
+  public:
+    void reset(MachineFunction &MF);
+
+    // Emit the replacement of MI before it. Returns the number of
+    // instructions emitted, 0 if MI is safe or not handled. The caller
+    // erases MI.
+    unsigned int rewrite(MachineInstr *MI);
+
+    // True if Imm, as the last byte of an instruction, is not a ret.
+    static bool isSafeImm8(int64_t Imm);
+
+  private:
+    MachineFunction *MF;
+    const X86Subtarget *STI;
+    const TargetInstrInfo *TII;
+    MachineRegisterInfo *MRI;
+
+    unsigned int rewritePermute(MachineInstr *MI, unsigned int Imm);
+    unsigned int rewriteSHUFPS(MachineInstr *MI, unsigned int Imm);
+    unsigned int rewriteBlend(MachineInstr *MI, unsigned int Imm);
+    unsigned int rewriteWithImm(MachineInstr *MI, unsigned int Imm);
+    unsigned int rewriteINSERTPS(MachineInstr *MI, unsigned int Imm);
+    unsigned int emitLanePermute(MachineInstr *MI, unsigned int Src, unsigned int Imm, bool Is256);
+  };
+
+}
+#endif
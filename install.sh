@@ -31,8 +31,8 @@ mkdir llvm-build;
 )
 
 echo -e "\n[+] Done!"
-echo "$PWD/llvm-build/bin/clang -mno-red-zone -fno-optimize-sibling-calls \"\$@\"" > clang-gfree
-echo "$PWD/llvm-build/bin/clang++ -mno-red-zone -fno-optimize-sibling-calls \"\$@\"" > clang++-gfree
+echo "$PWD/llvm-build/bin/clang -mno-red-zone \"\$@\"" > clang-gfree
+echo "$PWD/llvm-build/bin/clang++ -mno-red-zone \"\$@\"" > clang++-gfree
 chmod +x $PWD/clang-gfree $PWD/clang++-gfree
 echo "You can now install clang-gfree and clang++-gfree with: 
       ln -s $PWD/clang-gfree /usr/bin/clang-gfree